@@ -0,0 +1,29 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts every operator new in the program by replacing the global
+// allocation functions. They must be defined once per program, so include
+// this only from the translation unit that holds main().
+inline std::atomic<size_t> allocation_count(0);
+inline std::atomic<size_t> allocated_bytes(0);
+
+void* operator new(size_t n)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+// Out of line: once inlined into library code, GCC pairs the free() with the
+// caller's operator new and reports a false -Wmismatched-new-delete.
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef DECIMAL_LITERAL_H
+#define DECIMAL_LITERAL_H
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Decodes numeric literals as both lexers spell them, digits with at most one
+// '.', while the scanner walks them: digit() and point() for each byte, then
+// toInt() or toDouble(). The first 19 significant digits are accumulated in a
+// uint64_t with the power of ten they are scaled by. A float whose digits fit
+// in 53 bits and whose scale is at most 10^22 is then one correctly rounded
+// division (Clinger's fast path); longer ones fall back to std::from_chars
+// over the text, which rounds correctly too.
+class DecimalLiteral
+{
+public:
+    void digit(char c)
+    {
+        if (kept < MaxDigits) {
+            mantissa = mantissa * 10 + (uint64_t)(c - '0');
+            if (mantissa) kept++; // Leading zeros are not significant
+            if (fraction) scale--;
+        }
+        else {
+            truncated = true;
+            if (!fraction) scale++;
+        }
+    }
+
+    void point() { fraction = true; }
+
+    // False if the literal does not fit in int64_t; value is then INT64_MAX.
+    bool toInt(int64_t& value) const
+    {
+        if (truncated || mantissa > (uint64_t)INT64_MAX) {
+            value = INT64_MAX;
+            return false;
+        }
+        value = (int64_t)mantissa;
+        return true;
+    }
+
+    // text is the whole literal, for the slow path. False if the value is too
+    // large or too small for a double; value is then infinity or 0.
+    bool toDouble(std::string_view text, double& value) const
+    {
+        static constexpr double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                            1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                            1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        if (!truncated && mantissa <= (uint64_t)1 << 53 && scale >= -22) {
+            value = (double)mantissa / powers[-scale];
+            return true;
+        }
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        (void)end;
+        if (ec == std::errc()) return true;
+        value = kept + scale > 0 ? HUGE_VAL : 0.0;
+        return false;
+    }
+
+    // Decodes the whole of text into bits (see numberBits()) at once. False
+    // if it is out of range.
+    static bool decode(std::string_view text, bool isFloat, uint64_t& bits);
+
+private:
+    static constexpr int MaxDigits = 19;
+    uint64_t mantissa = 0;
+    int kept = 0;  // Significant digits in mantissa
+    int scale = 0; // mantissa * 10^scale is the value
+    bool fraction = false, truncated = false;
+};
+
+// A decoded literal in one 64-bit slot: an int64_t as is, a double as its
+// IEEE 754 bits.
+inline uint64_t numberBits(int64_t value) { return (uint64_t)value; }
+inline uint64_t numberBits(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+inline double doubleFromBits(uint64_t bits)
+{
+    double value;
+    std::memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+inline bool DecimalLiteral::decode(std::string_view text, bool isFloat, uint64_t& bits)
+{
+    DecimalLiteral literal;
+    for (char c : text) {
+        if (c == '.') literal.point();
+        else literal.digit(c);
+    }
+    bool inRange;
+    if (isFloat) {
+        double value;
+        inRange = literal.toDouble(text, value);
+        bits = numberBits(value);
+    }
+    else {
+        int64_t value;
+        inRange = literal.toInt(value);
+        bits = numberBits(value);
+    }
+    return inRange;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef LEXER_BATCH_H
+#define LEXER_BATCH_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "work_pool.h"
+
+// ---- Batch mode shared by both lexers (--batch) ----
+
+// What lexing one file printed: its token stream and its diagnostics.
+struct BatchOutput
+{
+    std::string tokens;
+    std::string diagnostics;
+    bool ok = true;
+};
+
+// The files named by a --batch argument: every regular file under a
+// directory, in sorted order, or the paths listed one per line in a file
+// ("-" reads the list from stdin). False, with error set, if the directory
+// or list cannot be read.
+inline bool collectBatchInputs(const std::string& spec, std::vector<std::string>& paths, std::string& error)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (spec != "-" && fs::is_directory(spec, ec)) {
+        fs::recursive_directory_iterator it(spec, fs::directory_options::skip_permission_denied, ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+            if (it->is_regular_file(ec)) paths.push_back(it->path().string());
+        }
+        if (ec) {
+            error = ec.message();
+            return false;
+        }
+        std::sort(paths.begin(), paths.end());
+        return true;
+    }
+
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (spec != "-") {
+        file.open(spec);
+        if (!file) {
+            error = "not a directory or readable file list";
+            return false;
+        }
+        in = &file;
+    }
+    for (std::string line; std::getline(*in, line); ) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) paths.push_back(line);
+    }
+    return true;
+}
+
+// Lexes every file with lexFile on the pool and writes the outputs in the
+// order of paths, each diagnostic line prefixed with its file's path. Small
+// neighbouring files are grouped into one task so that a tree of tiny files
+// does not pay a task per file; large files get a task of their own, and
+// lexFile may split them further on the same pool. The calling thread runs
+// tasks too while it waits for the next file in order. Returns 1 if any file
+// failed, else 0.
+inline int lexBatch(const std::vector<std::string>& paths, WorkPool& pool,
+                    const std::function<void(const std::string&, BatchOutput&)>& lexFile)
+{
+    const uintmax_t GroupBytes = 256 << 10;
+    const size_t GroupFiles = 64;
+
+    std::vector<BatchOutput> outputs(paths.size());
+    std::unique_ptr<bool[]> done(new bool[paths.size()]());
+    std::mutex doneMutex;
+    std::condition_variable doneChanged;
+
+    for (size_t first = 0; first < paths.size(); ) {
+        size_t last = first;
+        uintmax_t bytes = 0;
+        while (last < paths.size() && last - first < GroupFiles && bytes < GroupBytes) {
+            std::error_code ec;
+            uintmax_t size = std::filesystem::file_size(paths[last], ec);
+            if (last > first && !ec && bytes + size > GroupBytes) break;
+            bytes += ec ? 0 : size;
+            last++;
+        }
+        pool.submit([&, first, last] {
+            for (size_t i = first; i < last; i++) {
+                lexFile(paths[i], outputs[i]);
+                std::lock_guard<std::mutex> lock(doneMutex);
+                done[i] = true;
+                doneChanged.notify_all();
+            }
+        });
+        first = last;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(doneMutex);
+                if (done[i]) break;
+            }
+            if (pool.help()) continue;
+            std::unique_lock<std::mutex> lock(doneMutex);
+            doneChanged.wait(lock, [&] { return done[i]; });
+        }
+        BatchOutput& out = outputs[i];
+        std::cout << out.tokens;
+        for (size_t from = 0; from < out.diagnostics.size(); ) {
+            size_t to = out.diagnostics.find('\n', from);
+            to = to == std::string::npos ? out.diagnostics.size() : to + 1;
+            std::cerr << paths[i] << ": ";
+            std::cerr.write(out.diagnostics.data() + from, (std::streamsize)(to - from));
+            from = to;
+        }
+        if (!out.ok) status = 1;
+        out = BatchOutput();
+    }
+    std::cout.flush();
+    return status;
+}
+
+#endif
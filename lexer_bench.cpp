@@ -0,0 +1,542 @@
+// Benchmarks both lexers on generated corpora.
+//
+// Each lexer is compiled into this program in its own namespace, so a run
+// measures tokenize() alone: no process start-up, file reading or printing.
+// Every (lexer, corpus) pair runs in a forked child so its peak RSS is its
+// own. Results are printed as a table and written as JSON (bench_output.txt
+// by default) for comparing versions.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <chrono>
+#include <random>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "alloc_counter.h"
+#include "source_file.h"
+#include "scan_kernels.h"
+#include "regex_dfa.h"
+#include "token_spec.h"
+#include "lexer_stats.h"
+#include "work_pool.h"
+#include "lexer_batch.h"
+#include "token_cache.h"
+#include "token_stream.h"
+#include "token_printer.h"
+#include "symbol_table.h"
+#include "spsc_ring.h"
+#include "utf8.h"
+#include "decimal_literal.h"
+#include "lexer_server.h"
+
+namespace noregex {
+#define main noregex_main
+#include "lexer_noregex.cpp"
+#undef main
+}
+
+#undef TOKEN_ENUM
+#undef TOKEN_NAME
+#undef KEYWORD_SPELLING
+#undef SHARED_OPERATOR_SPELLING
+
+namespace regex {
+#define main regex_main
+#include "lexer_regex.cpp"
+#undef main
+}
+
+using namespace std;
+
+// ---- Corpus generation ----
+//
+// Every corpus is plain ASCII that both lexers accept, built from a fixed
+// seed so a given size and shape always produce the same bytes.
+
+class CorpusWriter {
+public:
+    explicit CorpusWriter(uint64_t seed) : rng(seed) {}
+
+    string build(const string& shape, size_t bytes) {
+        out.clear();
+        out.reserve(bytes + 256);
+        if (shape == "unclosed_comment") {
+            // A little code, then a comment that never closes
+            while (out.size() < bytes / 64) statement();
+            out += "/* unterminated\n";
+            while (out.size() < bytes) { words(8, 12); out += '\n'; }
+            return out;
+        }
+        while (out.size() < bytes) {
+            if (shape == "identifiers") statement();
+            else if (shape == "comments") { pick(4) ? comment() : statement(); }
+            else if (shape == "strings") stringAssignment();
+            else if (shape == "numbers") arithmetic();
+            else mixed();
+        }
+        return out;
+    }
+
+private:
+    mt19937_64 rng;
+    string out;
+    int depth = 0;
+
+    size_t pick(size_t n) { return (size_t)(rng() % n); }
+
+    void indent() { out.append((size_t)depth * 4, ' '); }
+
+    void identifier() {
+        static const char* const stems[] = {
+            "count", "index", "total", "buffer", "node", "value", "result", "left", "right",
+            "offset", "length", "item", "key", "state", "next", "prev", "acc", "tmp", "x", "y"
+        };
+        out += stems[pick(size(stems))];
+        if (pick(3) == 0) { out += '_'; out += stems[pick(size(stems))]; }
+        if (pick(4) == 0) out += to_string(pick(100));
+    }
+
+    void number() {
+        out += to_string(pick(100000));
+        if (pick(3) == 0) { out += '.'; out += to_string(pick(10000)); }
+    }
+
+    void words(size_t lo, size_t hi) {
+        static const char* const text[] = {
+            "the", "lexer", "reads", "each", "byte", "once", "and", "emits", "tokens", "for",
+            "every", "identifier", "number", "string", "operator", "in", "order", "*", "/", "-"
+        };
+        size_t n = lo + pick(hi - lo + 1);
+        for (size_t i = 0; i < n; i++) {
+            if (i) out += ' ';
+            out += text[pick(size(text))];
+        }
+    }
+
+    void expression(int terms) {
+        static const char* const ops[] = {" + ", " - ", " * ", " / ", " < ", " >= ", " == ", " != ", " && ", " || "};
+        for (int i = 0; i < terms; i++) {
+            if (i) out += ops[pick(size(ops))];
+            size_t k = pick(6);
+            if (k < 3) identifier();
+            else if (k < 5) number();
+            else { identifier(); out += '['; identifier(); out += ']'; }
+        }
+    }
+
+    void statement() {
+        static const char* const types[] = {"int ", "float ", "bool ", "string "};
+        indent();
+        size_t k = pick(8);
+        if (k < 4) {
+            out += types[pick(size(types))];
+            identifier();
+            out += " = ";
+            expression(1 + (int)pick(4));
+            out += ";\n";
+        } else if (k < 6 || depth >= 3) {
+            identifier();
+            out += " = ";
+            expression(1 + (int)pick(4));
+            out += ";\n";
+        } else if (k == 6) {
+            out += pick(2) ? "if (" : "while (";
+            expression(2 + (int)pick(2));
+            out += ") {\n";
+            depth++;
+            for (size_t i = 1 + pick(4); i > 0; i--) statement();
+            depth--;
+            indent();
+            out += "}\n";
+        } else {
+            out += "return ";
+            expression(1 + (int)pick(3));
+            out += ";\n";
+        }
+    }
+
+    void comment() {
+        indent();
+        if (pick(3)) {
+            out += "// ";
+            words(4, 14);
+            out += '\n';
+        } else {
+            out += "/* ";
+            for (size_t lines = 1 + pick(6); lines > 0; lines--) {
+                words(6, 12);
+                out += '\n';
+                indent();
+            }
+            out += "*/\n";
+        }
+    }
+
+    void stringAssignment() {
+        indent();
+        out += "string ";
+        identifier();
+        out += " = \"";
+        words(2, 16);
+        if (pick(4) == 0) out += "\\n";
+        if (pick(6) == 0) out += " \\\"quoted\\\"";
+        out += "\";\n";
+    }
+
+    void arithmetic() {
+        indent();
+        identifier();
+        out += " = ";
+        for (size_t i = 0, n = 3 + pick(6); i < n; i++) {
+            if (i) out += pick(2) ? " + " : " * ";
+            number();
+        }
+        out += ";\n";
+    }
+
+    void mixed() {
+        size_t k = pick(10);
+        if (k < 6) statement();
+        else if (k < 8) comment();
+        else if (k < 9) stringAssignment();
+        else arithmetic();
+    }
+};
+
+const char* const corpus_shapes[] = {"mixed", "identifiers", "comments", "strings", "numbers", "unclosed_comment"};
+
+// ---- Measurement ----
+
+struct Measurement {
+    size_t tokens = 0;
+    double bestSeconds = 0, medianSeconds = 0;
+    double allocations = 0, allocatedBytes = 0; // Per run
+    long peakRssKb = 0;
+    bool ok = false;
+};
+
+size_t lexOnce(const string& lexer, string_view src) {
+    if (lexer == "noregex") {
+        ostream sink(nullptr);
+        noregex::Lexer lx(src);
+        lx.setDiagnostics(sink);
+        return noregex::tokenize(lx, src).size();
+    }
+    regex::Lexer lx;
+    return lx.tokenize(src).size();
+}
+
+// One warm-up run (which also builds the regex lexer's DFA), then `runs`
+// timed runs.
+Measurement measure(const string& lexer, string_view src, int runs) {
+    Measurement m;
+    m.tokens = lexOnce(lexer, src);
+    vector<double> seconds;
+    size_t allocBefore = allocation_count.load(), bytesBefore = allocated_bytes.load();
+    for (int r = 0; r < runs; r++) {
+        auto start = chrono::steady_clock::now();
+        size_t n = lexOnce(lexer, src);
+        seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        if (n != m.tokens) return m;
+    }
+    m.allocations = double(allocation_count.load() - allocBefore) / runs;
+    m.allocatedBytes = double(allocated_bytes.load() - bytesBefore) / runs;
+    sort(seconds.begin(), seconds.end());
+    m.bestSeconds = seconds.front();
+    m.medianSeconds = seconds[seconds.size() / 2];
+    m.ok = true;
+    return m;
+}
+
+// Runs measure() in a child process and adds the child's peak RSS.
+Measurement measureIsolated(const string& lexer, string_view src, int runs) {
+    Measurement m;
+    int fds[2];
+    if (pipe(fds) != 0) return m;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return m;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        Measurement child = measure(lexer, src, runs);
+        ssize_t written = write(fds[1], &child, sizeof child);
+        _exit(written == (ssize_t)sizeof child ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &m, sizeof m);
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || got != (ssize_t)sizeof m || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return Measurement();
+    }
+    m.peakRssKb = usage.ru_maxrss;
+    return m;
+}
+
+// ---- Incremental re-lexing check (--check-relex N) ----
+//
+// Applies N random edits, eight at a time to short excerpts of a corpus,
+// bringing the noregex tokens up to date with relex() after each, and checks
+// them against a full tokenize() of the edited text: type, value, decoded
+// number, offset, line and column of every token. Edits insert and delete
+// fragments that open and close comments and strings, split numbers and add
+// UTF-8, and on a short text they keep landing next to each other, so the
+// resynchronisation paths get exercised. Done with and without --utf8.
+
+bool sameTokens(const noregex::TokenList& got, const noregex::TokenList& want, size_t& at) {
+    for (at = 0; at < got.size() && at < want.size(); at++) {
+        noregex::Token a = got[at], b = want[at];
+        noregex::Position pa = got.position(at), pb = want.position(at);
+        if (a.type != b.type || a.value != b.value || a.number != b.number || a.offset != b.offset ||
+            pa.line != pb.line || pa.column != pb.column) {
+            return false;
+        }
+    }
+    return got.size() == want.size();
+}
+
+// Reports the first mismatch and returns false; lexed and total count the
+// tokens relex() produced against a full lex's.
+bool checkRelex(const string& corpus, int edits, uint64_t seed, size_t& lexed, size_t& total) {
+    static const char* const fragments[] = {
+        "int ", "x", "_y9", " ", "\n", "\t", "\"ab\\\"c\"", "\"", "\"esc\\n", "\"a\\\nb\"", "//c\n", "//",
+        "/*a\n*/", "/*", "*/", "*", "/", "1.5", "12", "3.4.5", ".", "9lives", "==", "=", "+", "++", "@",
+        "\xce\xa9", "\xff", "\\", "\\\n"
+    };
+    const size_t ExcerptBytes = 512;
+    const int EditsPerExcerpt = 8;
+    mt19937_64 rng(seed);
+    ostream sink(nullptr);
+    // Tokens view the current text, so each edit is made in the other one
+    string texts[2];
+    int current = 0;
+    noregex::TokenList tokens{string_view()};
+    for (int e = 0; e < edits; e++) {
+        if (e % EditsPerExcerpt == 0) {
+            size_t start = (size_t)(rng() % (corpus.size() + 1));
+            texts[current] = corpus.substr(start, (size_t)(rng() % (ExcerptBytes + 1)));
+            noregex::Lexer first(texts[current]);
+            first.setDiagnostics(sink);
+            tokens = noregex::tokenize(first, texts[current]);
+        }
+        const string& text = texts[current];
+        string inserted;
+        for (size_t k = rng() % 3; k > 0; k--) inserted += fragments[rng() % size(fragments)];
+        size_t offset = (size_t)(rng() % (text.size() + 1));
+        size_t removed = (size_t)(rng() % (min<size_t>(8, text.size() - offset) + 1));
+        noregex::Edit edit = {offset, removed, inserted};
+        string& next = texts[1 - current];
+        next = text;
+        noregex::applyEdit(next, edit);
+        lexed += noregex::relex(tokens, next, edit, sink);
+        current = 1 - current;
+
+        noregex::Lexer full(texts[current]);
+        full.setDiagnostics(sink);
+        noregex::TokenList want = noregex::tokenize(full, texts[current]);
+        total += want.size();
+        size_t at;
+        if (!sameTokens(tokens, want, at)) {
+            cerr << "Error: relex() differs from a full lex after edit " << e + 1 << " (offset " << offset << ", "
+                 << removed << " removed, " << inserted.size() << " inserted) at token " << at << " of:\n"
+                 << texts[current] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---- Output ----
+
+struct Result {
+    string lexer, corpus;
+    size_t bytes;
+    Measurement m;
+};
+
+string jsonResults(const vector<Result>& results, size_t sizeBytes, int runs, uint64_t seed) {
+    ostringstream js;
+    js << fixed << setprecision(6);
+    js << "{\n  \"schema\": 1,\n  \"size_bytes\": " << sizeBytes << ",\n  \"runs\": " << runs
+       << ",\n  \"seed\": " << seed << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        const Measurement& m = r.m;
+        js << (i ? ",\n" : "\n") << "    {\"lexer\": \"" << r.lexer << "\", \"corpus\": \"" << r.corpus
+           << "\", \"ok\": " << (m.ok ? "true" : "false") << ", \"bytes\": " << r.bytes
+           << ", \"tokens\": " << m.tokens
+           << ", \"median_seconds\": " << m.medianSeconds << ", \"best_seconds\": " << m.bestSeconds
+           << ", \"mb_per_s\": " << (m.ok ? r.bytes / m.medianSeconds / 1e6 : 0.0)
+           << ", \"tokens_per_s\": " << (m.ok ? m.tokens / m.medianSeconds : 0.0)
+           << ", \"allocations\": " << m.allocations << ", \"allocated_bytes\": " << m.allocatedBytes
+           << ", \"peak_rss_kb\": " << m.peakRssKb << "}";
+    }
+    js << "\n  ]\n}\n";
+    return js.str();
+}
+
+void printTable(ostream& out, const vector<Result>& results) {
+    out << left << setw(9) << "lexer" << setw(18) << "corpus" << right
+         << setw(10) << "MB/s" << setw(14) << "Mtokens/s" << setw(12) << "allocs"
+         << setw(14) << "alloc MB" << setw(14) << "peak RSS MB" << endl;
+    out << fixed;
+    for (const Result& r : results) {
+        const Measurement& m = r.m;
+        out << left << setw(9) << r.lexer << setw(18) << r.corpus << right;
+        if (!m.ok) {
+            out << "  failed" << endl;
+            continue;
+        }
+        out << setprecision(1) << setw(10) << r.bytes / m.medianSeconds / 1e6
+             << setprecision(2) << setw(14) << m.tokens / m.medianSeconds / 1e6
+             << setprecision(0) << setw(12) << m.allocations
+             << setprecision(1) << setw(14) << m.allocatedBytes / 1e6
+             << setw(14) << m.peakRssKb / 1024.0 << endl;
+    }
+}
+
+vector<string> splitList(const string& s) {
+    vector<string> items;
+    stringstream in(s);
+    for (string item; getline(in, item, ',');) if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+// Parses all of text as a T; false if it is not one.
+template <typename T>
+bool parseNumber(string_view text, T& value) {
+    auto [end, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    return ec == errc() && end == text.data() + text.size();
+}
+
+void usage() {
+    cerr << "Usage: lexer_bench [--size MB] [--runs N] [--seed N] [--lexer noregex,regex]\n"
+            "                   [--corpus mixed,identifiers,...] [--json FILE|-] [--write-corpus DIR]\n"
+            "                   [--check-relex EDITS]\n"
+            "Corpora: mixed identifiers comments strings numbers unclosed_comment" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    double sizeMb = 8;
+    int runs = 5;
+    uint64_t seed = 1;
+    vector<string> lexers = {"noregex", "regex"};
+    vector<string> shapes(begin(corpus_shapes), end(corpus_shapes));
+    string jsonPath = "bench_output.txt";
+    string corpusDir;
+    int relexEdits = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        bool valid = true;
+        if (arg == "--size" && hasValue) valid = parseNumber(argv[++i], sizeMb) && sizeMb >= 0;
+        else if (arg == "--runs" && hasValue) valid = parseNumber(argv[++i], runs) && runs >= 1;
+        else if (arg == "--seed" && hasValue) valid = parseNumber(argv[++i], seed);
+        else if (arg == "--lexer" && hasValue) lexers = splitList(argv[++i]);
+        else if (arg == "--corpus" && hasValue) shapes = splitList(argv[++i]);
+        else if (arg == "--json" && hasValue) jsonPath = argv[++i];
+        else if (arg == "--write-corpus" && hasValue) corpusDir = argv[++i];
+        else if (arg == "--check-relex" && hasValue) valid = parseNumber(argv[++i], relexEdits) && relexEdits >= 1;
+        else {
+            usage();
+            return 1;
+        }
+        if (!valid) {
+            cerr << "Error: Invalid " << arg << " '" << argv[i] << "'" << endl;
+            usage();
+            return 1;
+        }
+    }
+    for (const string& l : lexers) {
+        if (l != "noregex" && l != "regex") {
+            cerr << "Error: Unknown lexer '" << l << "'" << endl;
+            return 1;
+        }
+    }
+    for (const string& s : shapes) {
+        if (find(begin(corpus_shapes), end(corpus_shapes), s) == end(corpus_shapes)) {
+            cerr << "Error: Unknown corpus '" << s << "'" << endl;
+            return 1;
+        }
+    }
+
+    size_t sizeBytes = (size_t)(sizeMb * 1e6);
+    if (relexEdits) {
+        bool ok = true;
+        for (const string& shape : shapes) {
+            string corpus = CorpusWriter(seed).build(shape, sizeBytes);
+            for (bool utf8 : {false, true}) {
+                noregex::lexer_utf8 = utf8;
+                size_t lexed = 0, total = 0;
+                bool same = checkRelex(corpus, relexEdits, seed, lexed, total);
+                cout << left << setw(18) << shape << (utf8 ? " utf8 " : "      ") << (same ? "ok" : "FAILED")
+                     << right << fixed << setprecision(3) << setw(10) << (total ? 100.0 * lexed / total : 0)
+                     << "% of tokens re-lexed" << endl;
+                ok &= same;
+            }
+        }
+        noregex::lexer_utf8 = false;
+        return ok ? 0 : 1;
+    }
+    if (!corpusDir.empty()) {
+        error_code ec;
+        filesystem::create_directories(corpusDir, ec);
+        if (ec) {
+            cerr << "Error: Could not create directory '" << corpusDir << "' (" << ec.message() << ")" << endl;
+            return 1;
+        }
+    }
+    vector<Result> results;
+    for (const string& shape : shapes) {
+        string corpus = CorpusWriter(seed).build(shape, sizeBytes);
+        if (!corpusDir.empty()) {
+            string path = corpusDir + "/" + shape + ".txt";
+            ofstream file(path, ios::binary);
+            if (!file.write(corpus.data(), (streamsize)corpus.size())) {
+                cerr << "Error: Could not write '" << path << "'" << endl;
+                return 1;
+            }
+            continue;
+        }
+        for (const string& lexer : lexers) {
+            results.push_back({lexer, shape, corpus.size(), measureIsolated(lexer, corpus, runs)});
+        }
+    }
+    if (!corpusDir.empty()) return 0;
+
+    printTable(jsonPath == "-" ? cerr : cout, results); // Keep stdout pure JSON for "-"
+    string json = jsonResults(results, sizeBytes, runs, seed);
+    if (jsonPath == "-") {
+        cout << json;
+    } else {
+        ofstream file(jsonPath);
+        if (!(file << json)) {
+            cerr << "Error: Could not write '" << jsonPath << "'" << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
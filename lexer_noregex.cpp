@@ -1,308 +1,1773 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <string>
-#include <set>
-#include <fstream>
-#include <cctype>
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include "source_file.h"
+#include "scan_kernels.h"
+#include "token_spec.h"
+#include "lexer_stats.h"
+#include "work_pool.h"
+#include "lexer_batch.h"
+#include "token_cache.h"
+#include "token_stream.h"
+#include "token_printer.h"
+#include "symbol_table.h"
+#include "spsc_ring.h"
+#include "utf8.h"
+#include "decimal_literal.h"
+#include "lexer_server.h"
 
 using namespace std;
 
-enum TokenType {
-    T_INT, T_FLOAT, T_STRING, T_BOOL, T_RETURN,
-    T_IF, T_ELSE, T_FOR, T_WHILE, T_BREAK, T_CONTINUE,
-    T_IDENTIFIER, T_INTLIT, T_FLOATLIT, T_STRINGLIT, T_BOOLLIT,
-    T_ASSIGNOP, T_EQUALSOP, T_PLUS, T_MINUS, T_MULT, T_DIV, T_MOD,
-    T_LT, T_GT, T_LTE, T_GTE, T_NEQ, T_AND, T_OR, T_NOT,
-    T_BITAND, T_BITOR, T_BITXOR, T_BITNOT, T_LEFTSHIFT, T_RIGHTSHIFT,
-    T_PARENL, T_PARENR, T_BRACEL, T_BRACER, T_BRACKL, T_BRACKR,
-    T_COMMA, T_SEMICOLON, T_COLON, T_QUESTION, T_DOT, T_COMMENT,
-    T_UNKNOWN, T_EOF, T_INVALID_IDENTIFIER, T_INCREMENT, T_PLUS_ASSIGN
+#define TOKEN_ENUM(type) type,
+enum TokenType { NOREGEX_TOKEN_TYPES(TOKEN_ENUM) };
+
+#define TOKEN_NAME(type) #type,
+const char* const token_names[] = { NOREGEX_TOKEN_TYPES(TOKEN_NAME) };
+
+struct Position {
+    int line;
+    int column;
+};
+
+// Replaces v[first, last) with `with`, moving the tail at most once.
+template <typename T>
+void replaceRange(vector<T>& v, size_t first, size_t last, const vector<T>& with) {
+    size_t common = min(last - first, with.size());
+    copy(with.begin(), with.begin() + (ptrdiff_t)common, v.begin() + (ptrdiff_t)first);
+    if (common < with.size()) v.insert(v.begin() + (ptrdiff_t)(first + common), with.begin() + (ptrdiff_t)common, with.end());
+    else v.erase(v.begin() + (ptrdiff_t)(first + common), v.begin() + (ptrdiff_t)last);
+}
+
+// Offsets of the newlines seen so far. Nothing tracks lines and columns
+// while lexing; at() finds them by binary search when a diagnostic or the
+// printer asks. A streaming lexer drops newlines it no longer needs with
+// forgetBefore(), so entries are stored relative to the first line still
+// indexed and stay 4 bytes wide however long the stream runs.
+//
+// With --utf8 the index also keeps the offsets of the continuation bytes of
+// multi-byte characters, and columns count characters instead of bytes. For
+// ASCII input, and without --utf8, that list stays empty.
+class LineIndex {
+public:
+    explicit LineIndex(int firstLine = 1) : baseLine(firstLine) {}
+
+    // An index of input read from lineStart, the first byte of firstLine.
+    LineIndex(int firstLine, size_t lineStart) : base(lineStart), baseLine(firstLine) {}
+
+    // Offsets must be added in increasing order.
+    void add(size_t offset) { newlines.push_back((uint32_t)(offset - base)); }
+    void addContinuation(size_t offset) { continuations.push_back((uint32_t)(offset - base)); }
+
+    // Where the last at(offset, hint) ended up; SIZE_MAX for not yet.
+    struct Hint {
+        size_t line = SIZE_MAX, lineContinuation = SIZE_MAX, continuation = SIZE_MAX;
+    };
+
+    Position at(size_t offset) const {
+        Hint none;
+        return at(offset, none);
+    }
+
+    // Offset of the first byte of the line that offset is on.
+    size_t lineStart(size_t offset) const {
+        uint32_t rel = (uint32_t)(offset - base);
+        size_t k = (size_t)(lower_bound(newlines.begin(), newlines.end(), rel) - newlines.begin());
+        return base + (k ? newlines[k - 1] + 1 : 0);
+    }
+
+    // at() for lookups in increasing order, as when printing: hint carries
+    // what the last lookup found, so the next one steps forward from it
+    // instead of searching the whole index.
+    Position at(size_t offset, Hint& hint) const {
+        uint32_t rel = (uint32_t)(offset - base);
+        hint.line = seek(newlines, rel, hint.line);
+        uint32_t lineStart = hint.line ? newlines[hint.line - 1] + 1 : 0;
+        int column = (int)(rel - lineStart) + 1;
+        if (!continuations.empty()) {
+            hint.lineContinuation = seek(continuations, lineStart, hint.lineContinuation);
+            hint.continuation = seek(continuations, rel, max(hint.continuation, hint.lineContinuation));
+            column -= (int)(hint.continuation - hint.lineContinuation);
+        }
+        return {baseLine + (int)hint.line, column};
+    }
+
+    // No offset before `offset` will be looked up again.
+    void forgetBefore(size_t offset) {
+        const size_t Batch = 4096; // Erase in batches
+        uint32_t rel = (uint32_t)(offset - base);
+        if (newlines.size() < Batch || newlines[Batch - 1] >= rel) return;
+        size_t k = (size_t)(lower_bound(newlines.begin(), newlines.end(), rel) - newlines.begin());
+        uint32_t shift = newlines[k - 1] + 1;
+        base += shift;
+        baseLine += (int)k;
+        newlines.erase(newlines.begin(), newlines.begin() + (ptrdiff_t)k);
+        for (uint32_t& n : newlines) n -= shift;
+        auto kept = lower_bound(continuations.begin(), continuations.end(), shift);
+        continuations.erase(continuations.begin(), kept);
+        for (uint32_t& c : continuations) c -= shift;
+    }
+
+    // Adds the newlines of an index over the input that starts at `offset`.
+    void append(const LineIndex& other, size_t offset) {
+        for (uint32_t n : other.newlines) add(offset + other.base + n);
+        for (uint32_t c : other.continuations) addContinuation(offset + other.base + c);
+    }
+
+    // After an edit: replaces the newlines in [from, to) with those region
+    // indexed in [from, regionEnd), and moves the ones from `to` on by delta
+    // bytes. to == SIZE_MAX replaces everything from `from` on. Continuation
+    // bytes are patched the same way.
+    void splice(size_t from, size_t to, const LineIndex& region, size_t regionEnd, ptrdiff_t delta) {
+        spliceOffsets(newlines, region.newlines, region.base, from, to, regionEnd, delta);
+        spliceOffsets(continuations, region.continuations, region.base, from, to, regionEnd, delta);
+    }
+
+    void save(ByteWriter& out) const {
+        out.put<uint64_t>(base);
+        out.put<int32_t>(baseLine);
+        out.putVector(newlines);
+        out.putVector(continuations);
+    }
+
+    bool load(ByteReader& in) {
+        uint64_t b;
+        int32_t line;
+        if (!in.get(b) || !in.get(line) || !in.getVector(newlines) || !in.getVector(continuations)) return false;
+        base = (size_t)b;
+        baseLine = line;
+        return is_sorted(newlines.begin(), newlines.end()) && is_sorted(continuations.begin(), continuations.end());
+    }
+
+private:
+    size_t base = 0; // Offset of the first byte of line baseLine
+    int baseLine;
+    vector<uint32_t> newlines;
+    vector<uint32_t> continuations;
+
+    // Index of the first entry of v not below x: stepping forward from hint
+    // when everything before hint is below x, else by binary search.
+    static size_t seek(const vector<uint32_t>& v, uint32_t x, size_t hint) {
+        if (hint > v.size() || (hint > 0 && v[hint - 1] >= x)) {
+            return (size_t)(lower_bound(v.begin(), v.end(), x) - v.begin());
+        }
+        while (hint < v.size() && v[hint] < x) hint++;
+        return hint;
+    }
+
+    void spliceOffsets(vector<uint32_t>& v, const vector<uint32_t>& with, size_t withBase, size_t from, size_t to,
+                       size_t regionEnd, ptrdiff_t delta) {
+        auto first = lower_bound(v.begin(), v.end(), (uint32_t)(from - base));
+        auto last = to == SIZE_MAX ? v.end() : lower_bound(first, v.end(), (uint32_t)(to - base));
+        for (auto k = last; k != v.end(); ++k) *k = (uint32_t)((ptrdiff_t)*k + delta);
+        vector<uint32_t> added;
+        for (uint32_t n : with) {
+            if (withBase + n < from) continue; // Indexed from the start of from's line
+            if (withBase + n >= regionEnd) break;
+            added.push_back((uint32_t)(withBase + n - base));
+        }
+        replaceRange(v, (size_t)(first - v.begin()), (size_t)(last - v.begin()), added);
+    }
 };
 
+// A token as Lexer::next() hands it out. offset is where the token starts in
+// the input; its line and column are looked up from that on demand. A
+// T_INTLIT or T_FLOATLIT also carries its decoded value in number.
 struct Token {
     TokenType type;
-    string value;
-    int line;
-    int column;
+    string_view value;
+    size_t offset;
+    uint64_t number = 0; // See numberBits()
+
+    int64_t intValue() const { return (int64_t)number; }
+    double floatValue() const { return doubleFromBits(number); }
+};
+
+// The tokens of one in-memory source as parallel arrays: a 1-byte type and a
+// 4-byte offset and length, 9 bytes per token, plus the newline index for
+// position(). A value is normally the source bytes at [offset, offset +
+// length), starting one byte later for a string literal's body. Values that
+// are not in the source (cooked string literals, the "/*..." of an unclosed
+// comment) are stored in literals and length indexes them instead. An
+// identifier's length slot holds its id in the list's symbol table, so equal
+// identifiers compare as equal ids; its value is the interned spelling. A
+// numeric literal's length slot indexes its decoded value and its length in
+// numberBits and numberLengths. The source must outlive the list and be
+// smaller than 4 GiB.
+class TokenList {
+public:
+    TokenList() = default;
+    explicit TokenList(string_view src) : source(src) {}
+
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    TokenType type(size_t i) const { return (TokenType)(types[i] & TypeBits); }
+    size_t offset(size_t i) const { return offsets[i]; }
+
+    string_view value(size_t i) const {
+        if (types[i] == T_IDENTIFIER) return symbolTable.name(lengths[i]);
+        if (isNumber(types[i])) return source.substr(offsets[i], numberLengths[lengths[i]]);
+        if (types[i] & Literal) return literals[lengths[i]];
+        return source.substr(offsets[i] + (types[i] & AfterQuote ? 1 : 0), lengths[i]);
+    }
+
+    // Decoded value of token i if it is a numeric literal, else 0.
+    uint64_t number(size_t i) const { return isNumber(types[i]) ? numberBits[lengths[i]] : 0; }
+
+    Token operator[](size_t i) const { return {type(i), value(i), offsets[i], number(i)}; }
+
+    // Symbol id of the identifier token i.
+    uint32_t symbol(size_t i) const { return lengths[i]; }
+    const SymbolTable& symbols() const { return symbolTable; }
+
+    Position position(size_t i) const { return lines.at(offsets[i]); }
+    Position position(size_t i, LineIndex::Hint& hint) const { return lines.at(offsets[i], hint); }
+    Position positionAt(size_t offset) const { return lines.at(offset); }
+    size_t lineStartAt(size_t offset) const { return lines.lineStart(offset); }
+
+    // Index of the first token starting at or after offset.
+    size_t lowerBound(size_t offset) const {
+        return (size_t)(lower_bound(offsets.begin(), offsets.end(), (uint32_t)offset) - offsets.begin());
+    }
+
+    void push_back(const Token& t) {
+        uint8_t type = (uint8_t)t.type;
+        uint32_t length = (uint32_t)t.value.size();
+        size_t at = (size_t)(t.value.data() - source.data());
+        if (t.type == T_IDENTIFIER) {
+            length = symbolTable.intern(t.value);
+        } else if (isNumber(type)) {
+            length = (uint32_t)numberBits.size();
+            numberBits.push_back(t.number);
+            numberLengths.push_back((uint32_t)t.value.size());
+        } else if (t.value.empty()) {
+            length = 0;
+        } else if (t.value.data() >= source.data() && at + t.value.size() <= source.size()) {
+            if (at != t.offset) type |= AfterQuote;
+        } else {
+            type |= Literal;
+            length = (uint32_t)literals.size();
+            literals.emplace_back(t.value);
+        }
+        types.push_back(type);
+        offsets.push_back((uint32_t)t.offset);
+        lengths.push_back(length);
+    }
+
+    void pop_back() {
+        if (types.back() & Literal) literals.pop_back();
+        if (isNumber(types.back())) {
+            numberBits.pop_back();
+            numberLengths.pop_back();
+        }
+        types.pop_back();
+        offsets.pop_back();
+        lengths.pop_back();
+    }
+
+    // Appends the tokens of a list over the part of this source that starts
+    // at `base`.
+    void append(TokenList&& other, size_t base) {
+        uint32_t firstLiteral = (uint32_t)literals.size();
+        uint32_t firstNumber = (uint32_t)numberBits.size();
+        vector<uint32_t> ids = symbolTable.absorb(other.symbolTable);
+        for (size_t i = 0; i < other.size(); i++) {
+            uint8_t type = other.types[i];
+            uint32_t length = other.lengths[i];
+            if (type == T_IDENTIFIER) length = ids[length];
+            else if (isNumber(type)) length += firstNumber;
+            else if (type & Literal) length += firstLiteral;
+            types.push_back(type);
+            offsets.push_back((uint32_t)(other.offsets[i] + base));
+            lengths.push_back(length);
+        }
+        for (string& s : other.literals) literals.push_back(std::move(s));
+        numberBits.insert(numberBits.end(), other.numberBits.begin(), other.numberBits.end());
+        numberLengths.insert(numberLengths.end(), other.numberLengths.begin(), other.numberLengths.end());
+        lines.append(other.lines, base);
+    }
+
+    // Writes everything but the source, for load() to read back.
+    void save(ByteWriter& out) const {
+        out.putVector(types);
+        out.putVector(offsets);
+        out.putVector(lengths);
+        out.put<uint64_t>(literals.size());
+        for (const string& lit : literals) out.putString(lit);
+        out.put<uint64_t>(symbolTable.size());
+        for (uint32_t id = 0; id < symbolTable.size(); id++) out.putString(symbolTable.name(id));
+        out.putVector(numberBits);
+        out.putVector(numberLengths);
+        lines.save(out);
+    }
+
+    // Reads what save() wrote for this list's source. False, leaving the
+    // list unusable, if the data is malformed or does not fit the source.
+    bool load(ByteReader& in) {
+        uint64_t count;
+        if (!in.getVector(types) || !in.getVector(offsets) || !in.getVector(lengths) || !in.get(count)) return false;
+        if (offsets.size() != types.size() || lengths.size() != types.size()) return false;
+        literals.clear();
+        for (uint64_t k = 0; k < count; k++) {
+            literals.emplace_back();
+            if (!in.getString(literals.back())) return false;
+        }
+        symbolTable = SymbolTable();
+        if (!in.get(count)) return false;
+        for (uint64_t k = 0; k < count; k++) {
+            string name;
+            if (!in.getString(name) || symbolTable.intern(name) != k) return false;
+        }
+        if (!in.getVector(numberBits) || !in.getVector(numberLengths) || numberLengths.size() != numberBits.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < size(); i++) {
+            if ((types[i] & TypeBits) >= std::size(token_names)) return false;
+            if (types[i] == T_IDENTIFIER) {
+                if (lengths[i] >= symbolTable.size()) return false;
+            } else if (isNumber(types[i])) {
+                if (lengths[i] >= numberBits.size() || (uint64_t)offsets[i] + numberLengths[lengths[i]] > source.size()) return false;
+            } else if (types[i] & Literal) {
+                if (lengths[i] >= literals.size()) return false;
+            } else if ((uint64_t)offsets[i] + (types[i] & AfterQuote ? 1 : 0) + lengths[i] > source.size()) {
+                return false;
+            }
+        }
+        return lines.load(in);
+    }
+
+    void setOffset(size_t i, size_t offset) { offsets[i] = (uint32_t)offset; }
+    void setLineIndex(LineIndex&& index) { lines = std::move(index); }
+    void spliceLines(size_t from, size_t to, const LineIndex& region, size_t regionEnd, ptrdiff_t delta) {
+        lines.splice(from, to, region, regionEnd, delta);
+    }
+
+    // After an edit that moved the source to newSource: replaces tokens
+    // [first, last) with those of region, whose offsets are already in
+    // newSource, and moves the tokens from last on by delta bytes. The line
+    // index is patched separately with spliceLines(). Symbols whose last
+    // occurrence was replaced stay in the table with their ids.
+    void splice(string_view newSource, size_t first, size_t last, TokenList&& region, ptrdiff_t delta) {
+        bool droppedLiteral = false, droppedNumber = false;
+        for (size_t i = first; i < last; i++) {
+            droppedLiteral |= (types[i] & Literal) != 0;
+            droppedNumber |= isNumber(types[i]);
+        }
+        for (size_t i = last; i < size(); i++) offsets[i] = (uint32_t)((ptrdiff_t)offsets[i] + delta);
+
+        uint32_t firstLiteral = (uint32_t)literals.size();
+        uint32_t firstNumber = (uint32_t)numberBits.size();
+        vector<uint32_t> ids = symbolTable.absorb(region.symbolTable);
+        for (size_t i = 0; i < region.size(); i++) {
+            if (region.types[i] == T_IDENTIFIER) region.lengths[i] = ids[region.lengths[i]];
+            else if (isNumber(region.types[i])) region.lengths[i] += firstNumber;
+            else if (region.types[i] & Literal) region.lengths[i] += firstLiteral;
+        }
+        for (string& lit : region.literals) literals.push_back(std::move(lit));
+        numberBits.insert(numberBits.end(), region.numberBits.begin(), region.numberBits.end());
+        numberLengths.insert(numberLengths.end(), region.numberLengths.begin(), region.numberLengths.end());
+        replaceRange(types, first, last, region.types);
+        replaceRange(offsets, first, last, region.offsets);
+        replaceRange(lengths, first, last, region.lengths);
+        source = newSource;
+
+        if (droppedLiteral) { // Renumber the literals still in use
+            vector<string> kept;
+            for (size_t i = 0; i < size(); i++) {
+                if (!(types[i] & Literal)) continue;
+                kept.push_back(std::move(literals[lengths[i]]));
+                lengths[i] = (uint32_t)(kept.size() - 1);
+            }
+            literals = std::move(kept);
+        }
+        if (droppedNumber) { // Likewise the numbers
+            vector<uint64_t> keptBits;
+            vector<uint32_t> keptLengths;
+            for (size_t i = 0; i < size(); i++) {
+                if (!isNumber(types[i])) continue;
+                keptBits.push_back(numberBits[lengths[i]]);
+                keptLengths.push_back(numberLengths[lengths[i]]);
+                lengths[i] = (uint32_t)(keptBits.size() - 1);
+            }
+            numberBits = std::move(keptBits);
+            numberLengths = std::move(keptLengths);
+        }
+    }
+
+private:
+    static constexpr uint8_t TypeBits = 0x3f, AfterQuote = 0x40, Literal = 0x80;
+    static_assert(std::size(token_names) <= TypeBits + 1, "token types must fit in the type byte");
+
+    // Numeric literals are always in the source, so their type byte has no flags
+    static bool isNumber(uint8_t type) { return type == T_INTLIT || type == T_FLOATLIT; }
+
+    string_view source;
+    vector<uint8_t> types;
+    vector<uint32_t> offsets, lengths;
+    vector<string> literals;
+    vector<uint64_t> numberBits;
+    vector<uint32_t> numberLengths;
+    SymbolTable symbolTable;
+    LineIndex lines;
+};
+
+#define KEYWORD_SPELLING(text, type) {text, type},
+constexpr Spelling<TokenType> keyword_spellings[] = {
+    SHARED_KEYWORDS(KEYWORD_SPELLING) NOREGEX_ONLY_KEYWORDS(KEYWORD_SPELLING)
+};
+constexpr KeywordTable keyword_table(keyword_spellings);
+static_assert(keyword_table.valid(), "no perfect hash for the keyword set");
+
+#define SHARED_OPERATOR_SPELLING(text, type, regexType) {text, type},
+constexpr Spelling<TokenType> operator_spellings[] = {
+    SHARED_OPERATORS(SHARED_OPERATOR_SPELLING) NOREGEX_ONLY_OPERATORS(KEYWORD_SPELLING)
 };
+constexpr OperatorTrie operator_trie(operator_spellings);
 
-const set<string> keywords = {
-    "int", "float", "string", "bool",
-    "return", "if", "else", "for", "while",
-    "break", "continue", "true", "false"
+// What a token starting with a given byte is, so that scan() dispatches on
+// its first byte with one table load and one switch rather than a run of
+// tests. The classes are the "C" locale ones the scanner always assumed,
+// fixed at compile time whatever locale the process runs in.
+enum class ByteClass : uint8_t {
+    Unknown,    // No token starts here
+    Space,      // ' ', '\t' .. '\r'
+    Identifier, // [A-Za-z_] and bytes >= 0x80
+    Digit,
+    Quote,
+    Slash,      // A comment or T_DIV
+    Operator,   // Starts a longer operator too: ask the trie
+    SingleOp    // A one-byte operator and nothing else; ByteInfo::type says which
 };
 
-vector<Token> tokenize(const string& src) {
-    vector<Token> tokens;
-    size_t pos = 0;
-    int line = 1, col = 1;
+struct ByteInfo {
+    ByteClass cls = ByteClass::Unknown;
+    uint8_t type = 0;
+};
+
+constexpr array<ByteInfo, 256> makeByteInfo() {
+    array<ByteInfo, 256> info{};
+    for (size_t b = 0; b < 256; b++) {
+        ByteClass& cls = info[b].cls;
+        if (b == ' ' || (b >= '\t' && b <= '\r')) cls = ByteClass::Space;
+        else if ((b >= 'A' && b <= 'Z') || (b >= 'a' && b <= 'z') || b == '_' || b >= 0x80) cls = ByteClass::Identifier;
+        else if (b >= '0' && b <= '9') cls = ByteClass::Digit;
+        else if (b == '"') cls = ByteClass::Quote;
+        else if (b == '/') cls = ByteClass::Slash;
+    }
+    for (const Spelling<TokenType>& op : operator_spellings) {
+        ByteInfo& first = info[(unsigned char)op.text[0]];
+        if (first.cls == ByteClass::Slash) continue;
+        if (op.text.size() == 1 && first.cls == ByteClass::Unknown) {
+            first = {ByteClass::SingleOp, (uint8_t)op.type};
+        } else {
+            first.cls = ByteClass::Operator;
+        }
+    }
+    return info;
+}
+constexpr array<ByteInfo, 256> byte_info = makeByteInfo();
+
+inline ByteClass byteClass(char c) { return byte_info[(unsigned char)c].cls; }
+
+// [A-Za-z0-9_]: what may follow the digits of an invalid identifier like 123abc
+inline bool isAsciiWordByte(char c) {
+    ByteClass cls = byteClass(c);
+    return (cls == ByteClass::Identifier && (unsigned char)c < 0x80) || cls == ByteClass::Digit;
+}
+
+// Lexers created on this thread while this is set report into it (see
+// --stats). Per thread so that batch workers can each count into their own.
+LEXER_STATS_ONLY(thread_local LexerStats* lexer_stats = nullptr;)
+
+// Lexers created while this is set check their input as UTF-8 (see --utf8).
+bool lexer_utf8 = false;
+
+#ifdef LEXER_STATS
+// Adds the symbol table of one lexed file to the stats.
+void countSymbols(const SymbolTable& symbols) {
+    if (!lexer_stats) return;
+    lexer_stats->symbols += symbols.size();
+    lexer_stats->symbolNameBytes += symbols.nameBytes();
+    lexer_stats->symbolTableBytes += symbols.arenaBytes() + symbols.tableBytes();
+}
+#endif
+
+// Decodes the body of a string literal (quotes excluded) into out, reusing
+// its capacity. A trailing lone backslash is dropped, matching the scanner
+// stopping at end of input.
+void unescapeLiteral(string_view raw, string& out) {
+    out.clear();
+    for (size_t i = 0; i < raw.size(); i++) {
+        if (raw[i] != '\\') { out += raw[i]; continue; }
+        if (++i >= raw.size()) break;
+        switch (raw[i]) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            default: out += raw[i]; break;
+        }
+    }
+}
+
+// Pull-based scanner behind tokenize(). Over an in-memory buffer it reads the
+// source in place; over a SourceStream it reads up to a chunk at a time, lexing
+// whatever has arrived, and only keeps the bytes of the token being scanned,
+// so memory stays bounded by the chunk size plus the longest single token. Comments are skipped as they stream by
+// and are never buffered whole.
+//
+// In UTF-8 mode (lexer_utf8) the scanner only ever sees input that has been
+// checked: end is a frontier that refill() moves forward a block at a time,
+// validating the bytes and indexing their newlines and continuation bytes on
+// the way. Identifiers are then XID_Start XID_Continue* per UAX #31, and each
+// ill-formed sequence is reported once, in source order with the tokens'
+// diagnostics. The scan loop itself is unchanged, so ASCII input costs one
+// extra vector pass.
+class Lexer {
+public:
+    explicit Lexer(string_view src)
+        : data(src.data()), end(src.size()), eof(true) { checkFrom(0); }
+
+    explicit Lexer(SourceStream& in, size_t chunkSize = 64 * 1024)
+        : input(&in), chunk(chunkSize ? chunkSize : 1) {}
+
+    // Lexes src as one slice of a larger input that starts at column 1 of
+    // startLine, possibly inside a block comment opened earlier. Unless
+    // isLast, running out of slice is not end of file: an open comment stays
+    // open (see endsInComment()) and no error is reported for it. Offsets
+    // count from the start of the slice.
+    Lexer(string_view src, int startLine, bool startInComment, bool isLast)
+        : data(src.data()), end(src.size()), eof(true), lastSlice(isLast),
+          inComment(startInComment), inheritedComment(startInComment), lines(startLine) { checkFrom(0); }
+
+    // Resumes lexing src at offset start, which must be where a token starts
+    // (in code, not inside a comment or string) and lies on `line`, which
+    // begins at offset lineStart. Offsets count from the start of src; only
+    // newlines from lineStart on are indexed.
+    Lexer(string_view src, size_t start, int line, size_t lineStart)
+        : data(src.data()), pos(start), end(src.size()), eof(true), lines(line, lineStart) {
+        checkFrom(lineStart);
+        reportFrom = start;
+    }
+
+    // Diagnostics go to cerr unless redirected here.
+    void setDiagnostics(ostream& out) { diag = &out; }
+    LEXER_STATS_ONLY(void setStats(LexerStats* s) { stats = s; })
+
+    // Returns the next token, and T_EOF from then on. The value is only valid
+    // until the following call when streaming (it may view the chunk buffer)
+    // or when it is a cooked string literal (it views the lexer's scratch
+    // string).
+    Token next();
+
+    // Line and column of an input offset already lexed. When streaming, call
+    // forgetPositionsBefore() with each token's offset once it is printed to
+    // keep the newline index from growing with the input.
+    Position position(size_t offset) const { return lines.at(offset); }
+    // For offsets in increasing order; see LineIndex::at(offset, hint).
+    Position position(size_t offset, LineIndex::Hint& hint) const { return lines.at(offset, hint); }
+    void forgetPositionsBefore(size_t offset) { lines.forgetBefore(offset); }
+    LineIndex takeLineIndex() { return std::move(lines); }
+
+    // Slice state after the last token. A comment inherited from an earlier
+    // slice has no start offset here; if it is still unclosed at end of file,
+    // unclosedInheritedComment() is set and the T_UNKNOWN token sits at
+    // offset 0 for the caller to move to the real start.
+    bool endsInComment() const { return inComment; }
+    bool commentInherited() const { return inheritedComment; }
+    size_t commentStartOffset() const { return commentStart; }
+    bool unclosedInheritedComment() const { return unclosedInherited; }
+
+private:
+    SourceStream* input = nullptr;
+    size_t chunk = 0;
+    vector<char> buffer;
+    const char* data = nullptr;
+    size_t pos = 0, end = 0, tokStart = 0;
+    size_t consumed = 0; // Input bytes dropped from the front of the buffer
+    bool eof = false;
+    bool lastSlice = true;
+    bool halted = false;
+    bool inComment = false, inheritedComment = false, unclosedInherited = false;
+    size_t commentStart = 0;
+    LineIndex lines;
+    ostream* diag = &cerr;
+    const ScanKernels& simd = scanKernels();
+    string cooked;
+    LEXER_STATS_ONLY(LexerStats* stats = lexer_stats;)
+
+    // UTF-8 mode: data holds `filled` bytes, checked up to end. Ill-formed
+    // sequences at or after reportFrom wait in badUtf8 until the scanner
+    // passes them, with their bytes, which streaming may have discarded.
+    static constexpr size_t CheckBlock = 64 * 1024;
+    struct BadUtf8 {
+        size_t offset, length;
+        unsigned char bytes[4];
+    };
+    bool utf8 = lexer_utf8;
+    size_t filled = 0;
+    size_t reportFrom = 0;
+    vector<BadUtf8> badUtf8;
+    size_t nextBad = 0;
+
+    Token scan();
+    Token scanUtf8Identifier();
+    Token numberToken(TokenType type, const DecimalLiteral& number);
+
+    // Every diagnostic is written through here.
+    ostream& report() {
+        LEXER_STATS_ONLY(if (stats) stats->errors++;)
+        return *diag;
+    }
+    LEXER_STATS_ONLY(void tally(LexerStats::ByteClass c, size_t n) { if (stats) stats->bytes[c] += n; })
+
+    // True if n bytes from pos are available, reading more input if needed.
+    bool need(size_t n) { return pos + n <= end || refill(n); }
+    bool refill(size_t n);
+    bool refillChecked(size_t n);
+    void discardBeforeToken();
+    size_t checkUtf8(size_t from, size_t to, bool final);
+    void reportBadUtf8(size_t before);
+
+    // UTF-8 mode: nothing past offset from is checked yet.
+    void checkFrom(size_t from) {
+        if (!utf8) return;
+        filled = end;
+        end = from;
+    }
+    string_view text() const { return string_view(data + tokStart, pos - tokStart); }
+
+    size_t offsetOf(size_t p) const { return consumed + p; }
+    Token token(TokenType type, string_view value) const { return {type, value, offsetOf(tokStart)}; }
+
+    // Adds the newlines in data[from, to) to the line index.
+    void indexNewlines(size_t from, size_t to) {
+        if (utf8) return; // checkUtf8() indexed them
+        const char* p = data + from;
+        const char* stop = data + to;
+        while ((p = (const char*)memchr(p, '\n', (size_t)(stop - p)))) {
+            lines.add(offsetOf((size_t)(p - data)));
+            p++;
+        }
+    }
+};
+
+// Discards everything before tokStart, rebases the positions and reads input
+// until n bytes past pos are buffered or it runs out. A read returns what has
+// arrived, so the caller lexes a partial chunk rather than waiting for more.
+bool Lexer::refill(size_t n) {
+    if (utf8) return refillChecked(n);
+    if (eof) return false;
+    discardBeforeToken();
+    while (pos + n > end && !eof) {
+        if (buffer.size() < end + chunk) buffer.resize(end + chunk);
+        size_t got = input->read(buffer.data() + end, chunk);
+        end += got;
+        eof = got == 0;
+    }
+    data = buffer.data();
+    return pos + n <= end;
+}
+
+void Lexer::discardBeforeToken() {
+    if (tokStart == 0) return;
+    size_t kept = utf8 ? filled : end;
+    memmove(buffer.data(), buffer.data() + tokStart, kept - tokStart);
+    consumed += tokStart;
+    pos -= tokStart;
+    end -= tokStart;
+    if (utf8) filled -= tokStart;
+    tokStart = 0;
+}
 
-    while (pos < src.size()) {
-        char c = src[pos];
+// refill() in UTF-8 mode: checks the bytes read a block at a time, and reads
+// another chunk when the check stalls on a sequence the chunk cut short, until
+// n bytes past pos are checked or the input runs out.
+bool Lexer::refillChecked(size_t n) {
+    while (pos + n > end) {
+        if (end < filled) {
+            size_t to = min(filled, max(end + CheckBlock, pos + n));
+            size_t stop = checkUtf8(end, to, eof && to == filled);
+            if (stop != end) {
+                end = stop;
+                continue;
+            }
+        }
+        if (eof) return false;
+        discardBeforeToken();
+        if (buffer.size() < filled + chunk) buffer.resize(filled + chunk);
+        size_t got = input->read(buffer.data() + filled, chunk);
+        filled += got;
+        eof = got == 0;
+        data = buffer.data();
+    }
+    return true;
+}
+
+// Checks data[from, to), indexing its newlines and the continuation bytes of
+// its characters and queueing its ill-formed sequences. Unless final, stops
+// before a sequence that the next bytes may complete. Returns where it
+// stopped.
+size_t Lexer::checkUtf8(size_t from, size_t to, bool final) {
+    size_t p = from;
+    while ((p = simd.utf8Stop(data, p, to)) < to) {
+        if (data[p] == '\n') {
+            lines.add(offsetOf(p++));
+            continue;
+        }
+        Utf8Char ch = decodeUtf8(data + p, to - p);
+        if (ch.incomplete && !final) break;
+        for (size_t k = 1; k < ch.length; k++) lines.addContinuation(offsetOf(p + k));
+        if (!ch.valid && offsetOf(p) >= reportFrom) {
+            BadUtf8 bad = {offsetOf(p), ch.length, {}};
+            memcpy(bad.bytes, data + p, ch.length);
+            badUtf8.push_back(bad);
+        }
+        p += ch.length;
+    }
+    return p;
+}
 
-        if (isspace(c)) {
-            if (c == '\n') { line++; col = 1; }
-            else { col++; }
+// Reports the queued ill-formed sequences that start before offset `before`.
+void Lexer::reportBadUtf8(size_t before) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (; nextBad < badUtf8.size() && badUtf8[nextBad].offset < before; nextBad++) {
+        const BadUtf8& bad = badUtf8[nextBad];
+        Position p = lines.at(bad.offset);
+        ostream& out = report();
+        out << "LexerError: Invalid UTF-8 sequence";
+        for (size_t k = 0; k < bad.length; k++) out << " 0x" << hex[bad.bytes[k] >> 4] << hex[bad.bytes[k] & 15];
+        out << " at Line " << p.line << ", Col " << p.column << endl;
+    }
+    if (nextBad == badUtf8.size()) {
+        badUtf8.clear();
+        nextBad = 0;
+    }
+}
+
+Token Lexer::next() {
+    Token t = scan();
+    if (nextBad < badUtf8.size()) reportBadUtf8(offsetOf(pos));
+    LEXER_STATS_ONLY(if (stats) stats->tokens[t.type]++;)
+    return t;
+}
+
+// The T_INTLIT or T_FLOATLIT token just scanned, with its value. A literal out
+// of range is reported and keeps the type, valued INT64_MAX, infinity or 0.
+Token Lexer::numberToken(TokenType type, const DecimalLiteral& number) {
+    Token t = token(type, text());
+    bool inRange;
+    if (type == T_INTLIT) {
+        int64_t value;
+        inRange = number.toInt(value);
+        t.number = numberBits(value);
+    } else {
+        double value;
+        inRange = number.toDouble(t.value, value);
+        t.number = numberBits(value);
+    }
+    if (!inRange) {
+        Position p = lines.at(t.offset);
+        report() << "LexerError: " << (type == T_INTLIT ? "Integer" : "Float") << " literal '" << t.value
+                 << "' out of range at Line " << p.line << ", Col " << p.column << endl;
+    }
+    return t;
+}
+
+// An identifier in UTF-8 mode, from tokStart: the identifier bytes the ASCII
+// scan accepts, cut at the first character that is not XID_Continue. A
+// non-ASCII first character that is ill-formed, already reported, or not
+// XID_Start is a T_UNKNOWN token of its own.
+Token Lexer::scanUtf8Identifier() {
+    do {
+        pos = simd.identEnd(data, pos, end);
+    } while (pos == end && need(1));
+    size_t stop = pos; // Never splits a character: the check stops between them
+    pos = tokStart;
+    while (pos < stop) {
+        if ((unsigned char)data[pos] < 0x80) {
             pos++;
             continue;
         }
+        Utf8Char ch = decodeUtf8(data + pos, stop - pos);
+        if (ch.valid && (pos == tokStart ? isXidStart(ch.cp) : isXidContinue(ch.cp))) {
+            pos += ch.length;
+            continue;
+        }
+        if (pos > tokStart) break;
+        pos += ch.length;
+        LEXER_STATS_ONLY(tally(LexerStats::Other, ch.length);)
+        if (ch.valid) {
+            Position p = lines.at(offsetOf(tokStart));
+            report() << "LexerError: Unknown character '" << text() << "' at Line " << p.line << ", Col " << p.column << endl;
+        }
+        return token(T_UNKNOWN, text());
+    }
+    string_view acc = text();
+    LEXER_STATS_ONLY(tally(LexerStats::Identifier, acc.size());)
+    if (const TokenType* keyword = keyword_table.find(acc)) return token(*keyword, acc);
+    return token(T_IDENTIFIER, acc);
+}
 
-        if (isalpha(c) || c == '_' || (unsigned char)c >= 128) {
-            int startCol = col;
-            string acc;
-            while (pos < src.size() && (isalnum(src[pos]) || src[pos] == '_' || (unsigned char)src[pos] >= 128)) {
-                acc += src[pos];
-                pos++;
-                col++;
-            }
+Token Lexer::scan() {
+    if (halted) return {T_EOF, "", offsetOf(pos)};
 
-            if (keywords.count(acc)) {
-                if (acc == "true" || acc == "false") tokens.push_back({T_BOOLLIT, acc, line, startCol});
-                else if (acc == "int") tokens.push_back({T_INT, acc, line, startCol});
-                else if (acc == "float") tokens.push_back({T_FLOAT, acc, line, startCol});
-                else if (acc == "string") tokens.push_back({T_STRING, acc, line, startCol});
-                else if (acc == "bool") tokens.push_back({T_BOOL, acc, line, startCol});
-                else if (acc == "return") tokens.push_back({T_RETURN, acc, line, startCol});
-                else if (acc == "if") tokens.push_back({T_IF, acc, line, startCol});
-                else if (acc == "else") tokens.push_back({T_ELSE, acc, line, startCol});
-                else if (acc == "for") tokens.push_back({T_FOR, acc, line, startCol});
-                else if (acc == "while") tokens.push_back({T_WHILE, acc, line, startCol});
-                else if (acc == "break") tokens.push_back({T_BREAK, acc, line, startCol});
-                else if (acc == "continue") tokens.push_back({T_CONTINUE, acc, line, startCol});
-            } else {
-                tokens.push_back({T_IDENTIFIER, acc, line, startCol});
+    while (true) {
+        if (inComment) {
+            while (true) {
+                size_t close = simd.commentClose(data, pos, end);
+                if (close != end) {
+                    LEXER_STATS_ONLY(tally(LexerStats::Comment, close - pos + 2);)
+                    indexNewlines(pos, close);
+                    pos = close;
+                    break;
+                }
+                size_t stop = end > pos ? end - 1 : pos; // A final '*' may pair with the next chunk
+                LEXER_STATS_ONLY(tally(LexerStats::Comment, stop - pos);)
+                indexNewlines(pos, stop);
+                tokStart = pos = stop;
+                if (!need(2)) break;
+            }
+            if (pos + 1 >= end) {
+                halted = true;
+                if (!lastSlice) {
+                    // A slice ends just after a newline, which still counts
+                    if (pos < end) {
+                        LEXER_STATS_ONLY(tally(LexerStats::Comment, 1);)
+                        indexNewlines(pos, end);
+                        pos = end;
+                    }
+                    return {T_EOF, "", offsetOf(pos)};
+                }
+                // The comment runs to the end: its bad sequences go before the
+                // error below, as when tokenizeParallel() adds that after a
+                // slice's diagnostics
+                if (nextBad < badUtf8.size()) reportBadUtf8(offsetOf(end));
+                if (inheritedComment) {
+                    unclosedInherited = true;
+                    return {T_UNKNOWN, "/*...", 0};
+                }
+                Position p = lines.at(commentStart);
+                report() << "LexerError: Unclosed multi-line comment starting at Line " << p.line << ", Col " << p.column << endl;
+                return {T_UNKNOWN, "/*...", commentStart}; // Critical Error: Stop tokenizing
             }
+            pos += 2;
+            inComment = inheritedComment = false;
             continue;
         }
 
-        if (isdigit(c)) {
-            int startCol = col;
-            string acc;
-            bool dotSeen = false;
-            while (pos < src.size()) {
-                if (isdigit(src[pos])) {
-                    acc += src[pos];
-                } 
-                else if (src[pos] == '.') {
-                    if (dotSeen) {
-                        cerr << "LexerError: Multiple decimal points in number '" 
-                            << acc << "' at Line " << line << ", Col " << startCol << endl;
-                        tokens.push_back({T_INVALID_IDENTIFIER, acc, line, startCol});
-                        return tokens; // or handle appropriately
-                    }
+        tokStart = pos;
+        if (nextBad < badUtf8.size()) reportBadUtf8(offsetOf(pos));
+        if (!need(1)) {
+            halted = true;
+            return {T_EOF, "", offsetOf(pos)};
+        }
+        const ByteInfo& first = byte_info[(unsigned char)data[pos]];
+
+        switch (first.cls) {
+        case ByteClass::Space:
+            do {
+                size_t stop = simd.spaceEnd(data, pos, end);
+                LEXER_STATS_ONLY(tally(LexerStats::Whitespace, stop - pos);)
+                indexNewlines(pos, stop);
+                tokStart = pos = stop;
+            } while (pos == end && need(1));
+            continue;
+
+        case ByteClass::Identifier: {
+            if (utf8) return scanUtf8Identifier();
+            do {
+                pos = simd.identEnd(data, pos, end);
+            } while (pos == end && need(1));
+            string_view acc = text();
+            LEXER_STATS_ONLY(tally(LexerStats::Identifier, acc.size());)
+
+            if (const TokenType* keyword = keyword_table.find(acc)) return token(*keyword, acc);
+            return token(T_IDENTIFIER, acc);
+        }
+
+        case ByteClass::Digit: {
+            DecimalLiteral number; // Decoded as it is scanned
+            bool dotSeen = false, extraDot = false;
+            while (need(1)) {
+                char d = data[pos];
+                if (d == '.') {
+                    extraDot |= dotSeen;
                     dotSeen = true;
-                    acc += '.';
-                } 
+                    number.point();
+                }
+                else if (byteClass(d) == ByteClass::Digit) number.digit(d);
                 else break;
                 pos++;
-                col++;
             }
             // Check invalid identifier like 123abc
-            if (pos < src.size() && (isalpha(src[pos]) || src[pos]=='_')) {
-                while (pos < src.size() && (isalnum(src[pos]) || src[pos]=='_')) {
-                    acc += src[pos];
+            bool invalid = extraDot;
+            if (need(1) && byteClass(data[pos]) == ByteClass::Identifier && (unsigned char)data[pos] < 0x80) {
+                while (need(1) && isAsciiWordByte(data[pos])) {
                     pos++;
-                    col++;
                 }
-                tokens.push_back({T_INVALID_IDENTIFIER, acc, line, startCol});
-            } else {
-                tokens.push_back(dotSeen ? Token{T_FLOATLIT, acc, line, startCol} : Token{T_INTLIT, acc, line, startCol});
+                invalid = true;
             }
-            continue;
+            LEXER_STATS_ONLY(tally(LexerStats::Number, pos - tokStart);)
+            if (extraDot) {
+                Position p = lines.at(offsetOf(tokStart));
+                report() << "LexerError: Multiple decimal points in number '" << text() << "' at Line " << p.line
+                         << ", Col " << p.column << endl;
+            }
+            if (invalid) return token(T_INVALID_IDENTIFIER, text());
+            return numberToken(dotSeen ? T_FLOATLIT : T_INTLIT, number);
         }
-        if (c == '"') {
-            int startCol = col;
-            int startLine = line;
-            string acc;
+
+        case ByteClass::Quote: {
             pos++; // Consume opening quote
-            col++;
-            while (pos < src.size() && src[pos] != '"' && src[pos] != '\n') {
-                if (src[pos] == '\\') { // Handle escape sequences
-                    pos++; col++;
-                    if (pos >= src.size()) break;
-                    switch(src[pos]) {
-                        case 'n': acc += '\n'; break;
-                        case 't': acc += '\t'; break;
-                        case 'r': acc += '\r'; break;
-                        case '"': acc += '"'; break;
-                        case '\\': acc += '\\'; break;
-                        default: acc += src[pos]; break;
-                    }
-                } else {
-                    acc += src[pos];
+            bool escaped = false;
+            while (true) {
+                pos = simd.stringStop(data, pos, end);
+                if (!need(1) || data[pos] == '"' || data[pos] == '\n') break;
+                if (data[pos] == '\\') { // Escapes are cooked below, only when present
+                    escaped = true;
+                    pos++;
+                    if (!need(1)) break;
+                    if (data[pos] == '\n' && !utf8) lines.add(offsetOf(pos));
+                    pos++;
                 }
-                pos++; col++;
             }
-            if (pos >= src.size() || src[pos] == '\n') {
-                cerr << "LexerError: Unclosed string literal at Line " << startLine << ", Col " << startCol << endl;
-                tokens.push_back({T_UNKNOWN, acc, startLine, startCol});
-            } else { // Found closing quote
-                pos++; col++;
-                tokens.push_back({T_STRINGLIT, acc, startLine, startCol});
+            bool closed = pos < end && data[pos] == '"';
+            LEXER_STATS_ONLY(tally(LexerStats::String, pos - tokStart + closed);)
+            string_view acc(data + tokStart + 1, pos - tokStart - 1);
+            if (escaped) {
+                unescapeLiteral(acc, cooked);
+                acc = cooked;
             }
-            continue;
+            if (!closed) {
+                Position p = lines.at(offsetOf(tokStart));
+                report() << "LexerError: Unclosed string literal at Line " << p.line << ", Col " << p.column << endl;
+                return token(T_UNKNOWN, acc);
+            }
+            pos++; // Found closing quote
+            return token(T_STRINGLIT, acc);
         }
 
-        if (c == '/' && pos + 1 < src.size()) {
-            if (src[pos + 1] == '/') {
+        case ByteClass::Slash:
+            if (!need(2)) break;
+            if (data[pos + 1] == '/') {
                 pos += 2;
-                while (pos < src.size() && src[pos] != '\n') { pos++; }
+                while (true) {
+                    const void* nl = memchr(data + pos, '\n', end - pos);
+                    if (nl) {
+                        pos = (size_t)((const char*)nl - data);
+                        LEXER_STATS_ONLY(tally(LexerStats::Comment, pos - tokStart);)
+                        break;
+                    }
+                    LEXER_STATS_ONLY(tally(LexerStats::Comment, end - tokStart);)
+                    tokStart = pos = end;
+                    if (!need(1)) break;
+                }
                 continue;
             }
-            if (src[pos + 1] == '*') {
-                int startCol = col;
-                int startLine = line;
+            if (data[pos + 1] == '*') {
+                LEXER_STATS_ONLY(tally(LexerStats::Comment, 2);)
+                inComment = true;
+                commentStart = offsetOf(pos);
                 pos += 2;
-                while (pos + 1 < src.size() && !(src[pos] == '*' && src[pos + 1] == '/')) {
-                    if (src[pos] == '\n') { line++; col = 1; }
-                    else { col++; }
-                    pos++;
-                }
-                if (pos + 1 >= src.size()) {
-                    cerr << "LexerError: Unclosed multi-line comment starting at Line " << startLine << ", Col " << startCol << endl;
-                    tokens.push_back({T_UNKNOWN, "/*...", startLine, startCol});
-                    break; // Critical Error: Stop tokenizing
-                } else {
-                    pos += 2;
-                }
                 continue;
             }
+            break;
+
+        case ByteClass::SingleOp:
+            pos++;
+            LEXER_STATS_ONLY(tally(LexerStats::Operator, 1);)
+            return token((TokenType)first.type, text());
+
+        case ByteClass::Operator:
+        case ByteClass::Unknown:
+            break;
+        }
+
+        need(operator_trie.maxLength());
+        auto op = operator_trie.longest(data + pos, min(end - pos, operator_trie.maxLength()));
+        size_t length = op.length ? op.length : 1;
+        pos += length;
+
+        string_view val = text();
+        LEXER_STATS_ONLY(tally(op.length ? LexerStats::Operator : LexerStats::Other, length);)
+        if (!op.length) {
+            Position p = lines.at(offsetOf(tokStart));
+            report() << "LexerError: Unknown character '" << val << "' at Line " << p.line << ", Col " << p.column << endl;
+            return token(T_UNKNOWN, val);
+        }
+        return token(op.type, val);
+    }
+}
+
+// Drains a lexer over the in-memory source src into a list.
+TokenList tokenize(Lexer& lexer, string_view src) {
+    TokenList result(src);
+    while (true) {
+        Token t = lexer.next();
+        result.push_back(t);
+        if (t.type == T_EOF) break;
+    }
+    result.setLineIndex(lexer.takeLineIndex());
+    return result;
+}
+
+TokenList tokenize(string_view src) {
+    Lexer lexer(src);
+    return tokenize(lexer, src);
+}
+
+// ---- Parallel lexing of one large buffer ----
+//
+// The buffer is cut into slices that each end just after a newline. A cheap
+// pre-pass over every slice tracks only whether the scanner would be in code,
+// a string or a block comment, and how many newlines it would count. Strings
+// normally end at a newline, but an escaped newline continues them, so a
+// slice that ends inside a string is merged with the next one. Every slice
+// then starts at column 1 in code or in a comment and is lexed on its own.
+
+enum class SliceState { Code, String, Comment };
+
+struct SliceSummary {
+    SliceState end;
+    int lines;
+};
+
+SliceSummary scanSlice(string_view s, SliceState state) {
+    int lines = 0;
+    size_t i = 0, n = s.size();
+    while (i < n) {
+        char c = s[i];
+        if (state == SliceState::Code) {
+            if (c == '\n') lines++;
+            else if (c == '"') state = SliceState::String;
+            else if (c == '/' && i + 1 < n && s[i + 1] == '/') {
+                while (i < n && s[i] != '\n') i++;
+                continue;
+            }
+            else if (c == '/' && i + 1 < n && s[i + 1] == '*') {
+                state = SliceState::Comment;
+                i += 2;
+                continue;
+            }
+        } else if (state == SliceState::String) {
+            if (c == '\\') {
+                if (i + 1 < n && s[i + 1] == '\n') lines++;
+                i++;
+            }
+            else if (c == '"') state = SliceState::Code;
+            else if (c == '\n') { state = SliceState::Code; lines++; }
+        } else {
+            if (c == '\n') lines++;
+            else if (c == '*' && i + 1 < n && s[i + 1] == '/') {
+                state = SliceState::Code;
+                i += 2;
+                continue;
+            }
+        }
+        i++;
+    }
+    return {state, lines};
+}
+
+// Produces exactly the tokens and diagnostics of tokenize(src), with the
+// slices lexed on pool. Diagnostics go to diag. Inputs smaller than two
+// slices, or a pool without workers, are lexed serially.
+TokenList tokenizeParallel(string_view src, WorkPool& pool, ostream& diag = cerr, size_t minSliceBytes = 1 << 20) {
+    if (pool.concurrency() < 2 || src.size() < 2 * minSliceBytes) {
+        Lexer lexer(src);
+        lexer.setDiagnostics(diag);
+        return tokenize(lexer, src);
+    }
+
+    LEXER_STATS_ONLY(LexerStats* sink = lexer_stats;) // Slices run on other threads
+    size_t target = max(minSliceBytes, src.size() / (pool.concurrency() * 4));
+    vector<size_t> cuts = {0};
+    while (src.size() - cuts.back() > target) {
+        size_t nl = src.find('\n', cuts.back() + target);
+        if (nl == string_view::npos || nl + 1 == src.size()) break;
+        cuts.push_back(nl + 1);
+    }
+    cuts.push_back(src.size());
+    size_t pieces = cuts.size() - 1;
+    auto piece = [&](size_t k) { return src.substr(cuts[k], cuts[k + 1] - cuts[k]); };
+
+    vector<SliceSummary> fromCode(pieces), fromComment(pieces);
+    pool.parallelFor(pieces, [&](size_t k) {
+        fromCode[k] = scanSlice(piece(k), SliceState::Code);
+        fromComment[k] = scanSlice(piece(k), SliceState::Comment);
+    });
+
+    struct Slice {
+        size_t begin, end;
+        int line;
+        bool inComment;
+    };
+    vector<Slice> slices;
+    SliceState state = SliceState::Code;
+    int line = 1;
+    for (size_t k = 0; k < pieces; ) {
+        Slice sl = {cuts[k], cuts[k + 1], line, state == SliceState::Comment};
+        SliceSummary sum = state == SliceState::Code ? fromCode[k] : fromComment[k];
+        for (k++; sum.end == SliceState::String && k < pieces; k++) {
+            SliceSummary rest = scanSlice(piece(k), SliceState::String);
+            sum.lines += rest.lines;
+            sum.end = rest.end;
+            sl.end = cuts[k + 1];
+        }
+        slices.push_back(sl);
+        line += sum.lines;
+        state = sum.end;
+    }
+
+    struct SliceResult {
+        TokenList tokens;
+        ostringstream diagnostics;
+        bool endsInComment, commentInherited, unclosedInherited;
+        size_t commentStart;
+        LEXER_STATS_ONLY(LexerStats stats{size(token_names)};)
+    };
+    vector<SliceResult> results(slices.size());
+    pool.parallelFor(slices.size(), [&](size_t k) {
+        const Slice& sl = slices[k];
+        Lexer lexer(src.substr(sl.begin, sl.end - sl.begin), sl.line, sl.inComment, k + 1 == slices.size());
+        SliceResult& r = results[k];
+        lexer.setDiagnostics(r.diagnostics);
+        LEXER_STATS_ONLY(lexer.setStats(sink ? &r.stats : nullptr);)
+        r.tokens = tokenize(lexer, src.substr(sl.begin, sl.end - sl.begin));
+        r.endsInComment = lexer.endsInComment();
+        r.commentInherited = lexer.commentInherited();
+        r.unclosedInherited = lexer.unclosedInheritedComment();
+        r.commentStart = sl.begin + lexer.commentStartOffset();
+    });
+
+    TokenList result(src);
+    size_t openComment = 0; // Start of the comment left open by earlier slices
+    for (size_t k = 0; k < results.size(); k++) {
+        SliceResult& r = results[k];
+        bool last = k + 1 == results.size();
+        TokenList& toks = r.tokens;
+        if (!last && !toks.empty() && toks.type(toks.size() - 1) == T_EOF) {
+            toks.pop_back();
+            LEXER_STATS_ONLY(r.stats.tokens[T_EOF]--;)
+        }
+        result.append(std::move(toks), slices[k].begin);
+
+        diag << r.diagnostics.str();
+        if (r.unclosedInherited) {
+            size_t at = result.size() - 1;
+            if (result.type(at) == T_EOF) at--; // Move the "/*..." token, not the T_EOF after it
+            result.setOffset(at, openComment);
+            Position p = result.positionAt(openComment);
+            diag << "LexerError: Unclosed multi-line comment starting at Line " << p.line << ", Col " << p.column << endl;
+            LEXER_STATS_ONLY(r.stats.errors++;)
+        }
+        LEXER_STATS_ONLY(if (sink) sink->merge(r.stats);)
+        if (r.endsInComment && !r.commentInherited) openComment = r.commentStart;
+    }
+    return result;
+}
+
+// The --cache directory, if one was given.
+TokenCache* token_cache = nullptr;
+
+// tokenizeParallel() through token_cache when it is set. A hit loads the
+// tokens instead of lexing and writes the diagnostics the first run printed.
+TokenList tokenizeCached(string_view src, WorkPool& pool, ostream& diag = cerr) {
+    if (!token_cache) return tokenizeParallel(src, pool, diag);
+
+    string payload;
+    if (token_cache->load(src, payload)) {
+        ByteReader in(payload);
+        TokenList cached(src);
+        string diagnostics;
+        if (in.getString(diagnostics) && cached.load(in) && in.atEnd()) {
+            diag << diagnostics;
+            return cached;
+        }
+    }
+
+    ostringstream diagnostics;
+    TokenList result = tokenizeParallel(src, pool, diagnostics);
+    string text = diagnostics.str();
+    diag << text;
+    payload.clear();
+    ByteWriter out(payload);
+    out.putString(text);
+    result.save(out);
+    token_cache->store(src, payload);
+    return result;
+}
+
+// ---- Incremental re-lexing ----
+//
+// Every token starts in code, so lexing can resume at any token start. After
+// an edit, relex() resumes at the last token that starts before the edit
+// (an edit can extend or merge it) and stops as soon as it produces a token
+// past the edit at the spot where a token started before the edit: the input
+// from there on is unchanged and the lexer is in the same state, so the old
+// tokens from there on are still right and only move by the edit's size
+// difference. Edits that open or close a comment or string simply keep the
+// lexer going until the streams line up again, or to the end of the input.
+
+// `removed` bytes at offset replaced by `inserted`.
+struct Edit {
+    size_t offset;
+    size_t removed;
+    string_view inserted;
+};
+
+void applyEdit(string& text, const Edit& edit) {
+    text.replace(edit.offset, edit.removed, edit.inserted);
+}
+
+// Brings tokens, the list of some source, up to date with src, which is that
+// source after edit. Diagnostics for the re-lexed part go to diag; those of
+// the untouched parts are not repeated. Returns how many tokens were lexed.
+size_t relex(TokenList& tokens, string_view src, const Edit& edit, ostream& diag = cerr) {
+    ptrdiff_t delta = (ptrdiff_t)edit.inserted.size() - (ptrdiff_t)edit.removed;
+    size_t editEnd = edit.offset + edit.inserted.size(); // In src
+    // Resume at the last token before the edit, never at a T_EOF (see below).
+    // In UTF-8 mode where a token ends can turn on the 3 bytes after it (the
+    // rest of a character), so the token before that one must end 3 bytes
+    // ahead of the edit.
+    size_t reach = lexer_utf8 ? 3 : 0;
+    size_t first = tokens.lowerBound(edit.offset > reach ? edit.offset - reach : 0);
+    if (first > 0 && first == tokens.size() && tokens.type(first - 1) == T_EOF) first--;
+    size_t restart = 0; // With no such token, the start of the input
+    if (first > 0) restart = tokens.offset(--first);
+
+    Lexer lexer(src, restart, tokens.positionAt(restart).line, tokens.lineStartAt(restart));
+    lexer.setDiagnostics(diag);
+
+    TokenList region(src);
+    size_t last = tokens.size(), old = first;
+    size_t resyncAt = src.size() + 1; // Offset in src where the old tokens take over
+    while (true) {
+        Token t = lexer.next();
+        // T_EOF is no restart point: after an unclosed comment it does not
+        // mark where the lexer was in code
+        if (t.type != T_EOF && t.offset >= editEnd) {
+            size_t oldOffset = (size_t)((ptrdiff_t)t.offset - delta);
+            while (old < tokens.size() && tokens.offset(old) < oldOffset) old++;
+            if (old < tokens.size() && tokens.offset(old) == oldOffset && tokens.type(old) != T_EOF) {
+                last = old;
+                resyncAt = t.offset;
+                break;
+            }
         }
+        region.push_back(t);
+        if (t.type == T_EOF) break;
+    }
+
+    // The token read at resyncAt may have indexed escaped newlines past it
+    bool resynced = resyncAt <= src.size();
+    tokens.spliceLines(restart, resynced ? (size_t)((ptrdiff_t)resyncAt - delta) : SIZE_MAX,
+                       lexer.takeLineIndex(), resyncAt, delta);
+    size_t lexed = region.size() + resynced;
+    tokens.splice(src, first, last, std::move(region), delta);
+    return lexed;
+}
+
+void printToken(TokenPrinter& out, const Token& t, Position p) {
+    if (out.format() != TokenFormat::Text) {
+        out.record(token_names[t.type], t.value, p.line, p.column);
+        return;
+    }
+    out.write(token_names[t.type]);
+    out.write("\t\"");
+    // Replace non-printable chars for clean output
+    out.write(t.value, Escaping::Text);
+    out.write("\"\tLine: ");
+    out.writeNumber(p.line);
+    out.write("\tCol: ");
+    out.writeNumber(p.column);
+    out.write('\n');
+}
 
-        int startCol = col;
-        string val(1, c);
-        pos++; col++;
-        if (c == '=' && pos < src.size() && src[pos] == '=') { val = "=="; pos++; col++; tokens.push_back({T_EQUALSOP, val, line, startCol}); continue; }
-        else if (c == '!' && pos < src.size() && src[pos] == '=') { val = "!="; pos++; col++; tokens.push_back({T_NEQ, val, line, startCol}); continue; }
-        else if (c == '<' && pos < src.size() && src[pos] == '=') { val = "<="; pos++; col++; tokens.push_back({T_LTE, val, line, startCol}); continue; }
-        else if (c == '>' && pos < src.size() && src[pos] == '=') { val = ">="; pos++; col++; tokens.push_back({T_GTE, val, line, startCol}); continue; }
-        else if (c == '&' && pos < src.size() && src[pos] == '&') { val = "&&"; pos++; col++; tokens.push_back({T_AND, val, line, startCol}); continue; }
-        else if (c == '|' && pos < src.size() && src[pos] == '|') { val = "||"; pos++; col++; tokens.push_back({T_OR, val, line, startCol}); continue; }
-        else if (c == '+' && pos < src.size() && src[pos] == '+') { val = "++"; pos++; col++; tokens.push_back({T_INCREMENT, val, line, startCol}); continue; }
-        else if (c == '+' && pos < src.size() && src[pos] == '=') { val = "+="; pos++; col++; tokens.push_back({T_PLUS_ASSIGN, val, line, startCol}); continue; }
-
-        TokenType type = T_UNKNOWN;
-        if (c == '+') type = T_PLUS;
-        else if (c == '-') type = T_MINUS;
-        else if (c == '*') type = T_MULT;
-        else if (c == '/') type = T_DIV;
-        else if (c == '%') type = T_MOD;
-        else if (c == '<') type = T_LT;
-        else if (c == '>') type = T_GT;
-        else if (c == '!') type = T_NOT;
-        else if (c == '&') type = T_BITAND;
-        else if (c == '|') type = T_BITOR;
-        else if (c == '^') type = T_BITXOR;
-        else if (c == '~') type = T_BITNOT;
-        else if (c == '(') type = T_PARENL;
-        else if (c == ')') type = T_PARENR;
-        else if (c == '{') type = T_BRACEL;
-        else if (c == '}') type = T_BRACER;
-        else if (c == '[') type = T_BRACKL;
-        else if (c == ']') type = T_BRACKR;
-        else if (c == ',') type = T_COMMA;
-        else if (c == ';') type = T_SEMICOLON;
-        else if (c == ':') type = T_COLON;
-        else if (c == '?') type = T_QUESTION;
-        else if (c == '.') type = T_DOT;
-        else if (c == '=') type = T_ASSIGNOP;
-
-        if (type == T_UNKNOWN) {
-            cerr << "LexerError: Unknown character '" << val << "' at Line " << line << ", Col " << startCol << endl;
-        }
-        tokens.push_back({type, val, line, startCol});
-    }
-
-    tokens.push_back({T_EOF, "", line, col});
-    return tokens;
-}
-
-string tokenTypeToString(TokenType type) {
-    switch (type) {
-        case T_INT: return "T_INT";
-        case T_FLOAT: return "T_FLOAT";
-        case T_STRING: return "T_STRING";
-        case T_BOOL: return "T_BOOL";
-        case T_RETURN: return "T_RETURN";
-        case T_IF: return "T_IF";
-        case T_ELSE: return "T_ELSE";
-        case T_FOR: return "T_FOR";
-        case T_WHILE: return "T_WHILE";
-        case T_BREAK: return "T_BREAK";
-        case T_CONTINUE: return "T_CONTINUE";
-        case T_IDENTIFIER: return "T_IDENTIFIER";
-        case T_INTLIT: return "T_INTLIT";
-        case T_FLOATLIT: return "T_FLOATLIT";
-        case T_STRINGLIT: return "T_STRINGLIT";
-        case T_BOOLLIT: return "T_BOOLLIT";
-        case T_ASSIGNOP: return "T_ASSIGNOP";
-        case T_EQUALSOP: return "T_EQUALSOP";
-        case T_PLUS: return "T_PLUS";
-        case T_MINUS: return "T_MINUS";
-        case T_MULT: return "T_MULT";
-        case T_DIV: return "T_DIV";
-        case T_MOD: return "T_MOD";
-        case T_LT: return "T_LT";
-        case T_GT: return "T_GT";
-        case T_LTE: return "T_LTE";
-        case T_GTE: return "T_GTE";
-        case T_NEQ: return "T_NEQ";
-        case T_AND: return "T_AND";
-        case T_OR: return "T_OR";
-        case T_NOT: return "T_NOT";
-        case T_BITAND: return "T_BITAND";
-        case T_BITOR: return "T_BITOR";
-        case T_BITXOR: return "T_BITXOR";
-        case T_BITNOT: return "T_BITNOT";
-        case T_LEFTSHIFT: return "T_LEFTSHIFT";
-        case T_RIGHTSHIFT: return "T_RIGHTSHIFT";
-        case T_PARENL: return "T_PARENL";
-        case T_PARENR: return "T_PARENR";
-        case T_BRACEL: return "T_BRACEL";
-        case T_BRACER: return "T_BRACER";
-        case T_BRACKL: return "T_BRACKL";
-        case T_BRACKR: return "T_BRACKR";
-        case T_COMMA: return "T_COMMA";
-        case T_SEMICOLON: return "T_SEMICOLON";
-        case T_COLON: return "T_COLON";
-        case T_QUESTION: return "T_QUESTION";
-        case T_DOT: return "T_DOT";
-        case T_COMMENT: return "T_COMMENT";
-        case T_UNKNOWN: return "T_UNKNOWN";
-        case T_EOF: return "T_EOF";
-        case T_INVALID_IDENTIFIER: return "T_INVALID_IDENTIFIER";
-        case T_INCREMENT: return "T_INCREMENT";
-        case T_PLUS_ASSIGN: return "T_PLUS_ASSIGN";
-        default: return "T_UNKNOWN";
-    }
-}
-
-int main() {
-    ifstream file("test_input2.txt");
-    if (!file) {
-        cerr << "Error: Could not open file 'test_input2.txt'" << endl;
+// True, having said so, if input stopped on a read error rather than at its
+// end.
+bool readFailed(const SourceStream& input, const string& path) {
+    if (input.error().empty()) return false;
+    cerr << "Error: Could not read '" << path << "' (" << input.error() << ")" << endl;
+    return true;
+}
+
+// Lexes and prints tokens as the input arrives instead of loading it first.
+int runStreaming(const string& path, TokenFormat format) {
+    SourceStream input;
+    if (!input.open(path)) {
+        cerr << "Error: Could not open file '" << path << "' (" << input.error() << ")" << endl;
         return 1;
     }
-    string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
 
-    vector<Token> tokens = tokenize(source);
+    Lexer lexer(input);
+    // No bigger than a few input chunks, so output keeps up with the input
+    TokenPrinter printer(cout, format, {}, 256 << 10);
+    // Before waiting on input, print what it has given so far
+    input.onWait([&] {
+        printer.flush();
+        cout.flush();
+    });
+    if (format == TokenFormat::Text) printer.write("--- Token Stream ---\n");
+    LineIndex::Hint hint;
+    while (true) {
+        LEXER_STATS_ONLY(PhaseTimer lexTimer(lexer_stats, LexerStats::Lex);)
+        Token t = lexer.next();
+        LEXER_STATS_ONLY(lexTimer.stop();)
+        LEXER_STATS_ONLY(PhaseTimer emitTimer(lexer_stats, LexerStats::Emit);)
+        printToken(printer, t, lexer.position(t.offset, hint));
+        lexer.forgetPositionsBefore(t.offset);
+        if (t.type == T_EOF) break;
+    }
+    return readFailed(input, path) ? 1 : 0;
+}
+
+// One slot of the --pipeline ring: a run of tokens with their positions,
+// and their values copied out of the lexer's chunk buffer.
+struct TokenBatch {
+    struct Entry {
+        TokenType type;
+        size_t valueStart, valueLength; // In values
+        size_t offset;
+        Position position;
+    };
+    vector<Entry> tokens;
+    string values;
+};
 
-    cout << "--- Token Stream ---" << endl;
-    for (const auto& t : tokens) {
-        // Replace non-printable chars for clean output
-        string val_printable;
-        for (char ch : t.value) {
-            if (ch == '\n') val_printable += "\\n";
-            else if (ch == '\t') val_printable += "\\t";
-            else if (ch == '\r') val_printable += "\\r";
-            else val_printable += ch;
+// runStreaming() with the lexer on a thread of its own. It fills batches of
+// tokens in a ring of a few and this thread prints them as they come, so
+// lexing overlaps printing while memory stays bounded as in --stream: when
+// printing falls behind, the lexer waits for a free batch. A batch goes out
+// early when the lexer is about to wait on input, and the printer flushes
+// when it runs out of batches, so output keeps up with a slow input.
+int runPipelined(const string& path, TokenFormat format) {
+    SourceStream input;
+    if (!input.open(path)) {
+        cerr << "Error: Could not open file '" << path << "' (" << input.error() << ")" << endl;
+        return 1;
+    }
+
+    const size_t BatchTokens = 4096, BatchBytes = 64 << 10;
+    SpscRing<TokenBatch> ring(8);
+    LEXER_STATS_ONLY(LexerStats* sink = lexer_stats;) // Per thread; the lexer's thread has none
+    thread lexing([&] {
+        Lexer lexer(input);
+        LEXER_STATS_ONLY(lexer.setStats(sink);)
+        LineIndex::Hint hint;
+        TokenBatch* batch = nullptr;
+        auto startBatch = [&] {
+            batch = &ring.startWrite();
+            batch->tokens.clear();
+            batch->values.clear();
+        };
+        input.onWait([&] {
+            if (batch->tokens.empty()) return;
+            ring.finishWrite();
+            startBatch();
+        });
+        for (bool done = false; !done; ) {
+            startBatch();
+            LEXER_STATS_ONLY(PhaseTimer lexTimer(sink, LexerStats::Lex);)
+            while (!done && batch->tokens.size() < BatchTokens && batch->values.size() < BatchBytes) {
+                Token t = lexer.next();
+                batch->tokens.push_back({t.type, batch->values.size(), t.value.size(), t.offset, lexer.position(t.offset, hint)});
+                batch->values += t.value;
+                lexer.forgetPositionsBefore(t.offset);
+                done = t.type == T_EOF;
+            }
+            LEXER_STATS_ONLY(lexTimer.stop();)
+            ring.finishWrite();
         }
-        cout << tokenTypeToString(t.type) << "\t\"" << val_printable
-             << "\"\tLine: " << t.line << "\tCol: " << t.column << endl;
+        ring.close();
+    });
+
+    TokenPrinter printer(cout, format, {}, 256 << 10);
+    if (format == TokenFormat::Text) printer.write("--- Token Stream ---\n");
+    while (true) {
+        if (!ring.ready()) {
+            printer.flush();
+            cout.flush();
+        }
+        TokenBatch* batch = ring.startRead();
+        if (!batch) break;
+        LEXER_STATS_ONLY(PhaseTimer emitTimer(lexer_stats, LexerStats::Emit);)
+        string_view values = batch->values;
+        for (const TokenBatch::Entry& e : batch->tokens) {
+            printToken(printer, {e.type, values.substr(e.valueStart, e.valueLength), e.offset}, e.position);
+        }
+        LEXER_STATS_ONLY(emitTimer.stop();)
+        ring.finishRead();
+    }
+    lexing.join();
+    return readFailed(input, path) ? 1 : 0;
+}
+
+// Writes the tokens of source as a binary token stream to out.
+bool writeBinary(ostream& out, const TokenList& tokens, string_view source, string diagnostics) {
+    TokenStreamWriter writer("noregex", token_names, size(token_names), source);
+    for (size_t i = 0; i < tokens.size(); i++) writer.add(tokens.type(i), tokens.value(i), tokens.offset(i), tokens.number(i));
+    writer.setDiagnostics(move(diagnostics));
+    return writer.write(out);
+}
+
+// As above, to path ("-" for stdout).
+bool writeBinary(const string& path, const TokenList& tokens, string_view source, string diagnostics) {
+    if (path == "-") return writeBinary(cout, tokens, source, move(diagnostics));
+    ofstream file(path, ios::binary | ios::trunc);
+    return file && writeBinary(file, tokens, source, move(diagnostics));
+}
+
+// Prints a lexed input's tokens, under the listing's header in text format.
+void printTokens(TokenPrinter& printer, const TokenList& tokens) {
+    if (printer.format() == TokenFormat::Text) printer.write("--- Token Stream ---\n");
+    LineIndex::Hint hint;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        printToken(printer, tokens[i], tokens.position(i, hint));
+    }
+}
+
+// Loads the whole input, lexes it (on `jobs` threads if more than one) and
+// prints the tokens in format or, with binaryPath set, as a binary stream.
+int runBuffered(const string& path, unsigned jobs, TokenFormat format, const string& binaryPath) {
+    LEXER_STATS_ONLY(PhaseTimer readTimer(lexer_stats, LexerStats::Read);)
+    SourceFile source;
+    if (!source.open(path)) {
+        cerr << "Error: Could not open file '" << path << "' (" << source.error() << ")" << endl;
+        return 1;
+    }
+    if (source.view().size() > UINT32_MAX) {
+        cerr << "Error: '" << path << "' is 4 GiB or larger; use --stream" << endl;
+        return 1;
     }
+    LEXER_STATS_ONLY(readTimer.stop();)
+
+    LEXER_STATS_ONLY(PhaseTimer lexTimer(lexer_stats, LexerStats::Lex);)
+    WorkPool pool(jobs - 1);
+    ostringstream diagnostics;
+    TokenList result = tokenizeCached(source.view(), pool, binaryPath.empty() ? cerr : diagnostics);
+    LEXER_STATS_ONLY(lexTimer.stop();)
+    LEXER_STATS_ONLY(countSymbols(result.symbols());)
+
+    LEXER_STATS_ONLY(PhaseTimer emitTimer(lexer_stats, LexerStats::Emit);)
+    if (!binaryPath.empty()) {
+        cerr << diagnostics.str();
+        if (!writeBinary(binaryPath, result, source.view(), diagnostics.str())) {
+            cerr << "Error: Could not write '" << binaryPath << "'" << endl;
+            return 1;
+        }
+        return 0;
+    }
+    TokenPrinter printer(cout, format);
+    printTokens(printer, result);
 
     return 0;
+}
+
+// Lexes one file of a --batch run into out. Large files are split across
+// the pool the way --jobs splits a single input.
+void lexBatchFile(const string& path, WorkPool& pool, TokenFormat format, BatchOutput& out) {
+    ostringstream tokens, diagnostics;
+    LEXER_STATS_ONLY(PhaseTimer readTimer(lexer_stats, LexerStats::Read);)
+    SourceFile source;
+    if (!source.open(path)) {
+        diagnostics << "Error: Could not open file '" << path << "' (" << source.error() << ")" << endl;
+        out.ok = false;
+    }
+    else if (source.view().size() > UINT32_MAX) {
+        diagnostics << "Error: '" << path << "' is 4 GiB or larger; use --stream" << endl;
+        out.ok = false;
+    }
+    else {
+        LEXER_STATS_ONLY(readTimer.stop();)
+        LEXER_STATS_ONLY(PhaseTimer lexTimer(lexer_stats, LexerStats::Lex);)
+        TokenList result = tokenizeCached(source.view(), pool, diagnostics);
+        LEXER_STATS_ONLY(lexTimer.stop();)
+        LEXER_STATS_ONLY(countSymbols(result.symbols());)
+
+        LEXER_STATS_ONLY(PhaseTimer emitTimer(lexer_stats, LexerStats::Emit);)
+        {
+            TokenPrinter printer(tokens, format, path, 64 << 10);
+            if (format == TokenFormat::Text) {
+                printer.write("--- Token Stream: ");
+                printer.write(path);
+                printer.write(" ---\n");
+            }
+            LineIndex::Hint hint;
+            for (size_t i = 0; i < result.size(); i++) {
+                printToken(printer, result[i], result.position(i, hint));
+            }
+        }
+        out.tokens = tokens.str();
+    }
+    out.diagnostics = diagnostics.str();
+}
+
+// Lexes every file named by spec (see collectBatchInputs) on `jobs` threads
+// and prints their token streams one after another in input order.
+int runBatch(const string& spec, unsigned jobs, TokenFormat format) {
+    vector<string> paths;
+    string error;
+    if (!collectBatchInputs(spec, paths, error)) {
+        cerr << "Error: Could not read batch input '" << spec << "' (" << error << ")" << endl;
+        return 1;
+    }
+
+    WorkPool pool(jobs - 1);
+#ifdef LEXER_STATS
+    LexerStats* sink = lexer_stats;
+    mutex sinkMutex;
+    return lexBatch(paths, pool, [&](const string& path, BatchOutput& out) {
+        if (!sink) return lexBatchFile(path, pool, format, out);
+        LexerStats fileStats(size(token_names));
+        LexerStats* saved = lexer_stats;
+        lexer_stats = &fileStats;
+        lexBatchFile(path, pool, format, out);
+        lexer_stats = saved;
+        lock_guard<mutex> lock(sinkMutex);
+        sink->merge(fileStats);
+    });
+#else
+    return lexBatch(paths, pool, [&](const string& path, BatchOutput& out) { lexBatchFile(path, pool, format, out); });
+#endif
+}
 
+// One line of a --relex edit list: "offset removed text", the text escaped
+// as in the text listing (\n, \t, \r and \\). False if it is not that.
+bool parseEdit(string_view line, size_t& offset, size_t& removed, string& text) {
+    auto number = [&](size_t& value) {
+        auto [end, ec] = from_chars(line.data(), line.data() + line.size(), value);
+        if (ec != errc() || end == line.data()) return false;
+        line.remove_prefix((size_t)(end - line.data()));
+        return true;
+    };
+    if (!number(offset) || line.empty() || line[0] != ' ') return false;
+    line.remove_prefix(1);
+    if (!number(removed)) return false;
+    if (!line.empty() && line[0] != ' ') return false;
+    if (!line.empty()) line.remove_prefix(1);
+    text.clear();
+    for (size_t i = 0; i < line.size(); i++) {
+        if (line[i] != '\\') {
+            text += line[i];
+            continue;
+        }
+        if (++i == line.size()) return false;
+        switch (line[i]) {
+        case 'n': text += '\n'; break;
+        case 't': text += '\t'; break;
+        case 'r': text += '\r'; break;
+        case '\\': text += '\\'; break;
+        default: return false;
+        }
+    }
+    return true;
 }
 
+// Lexes the input, then applies the edits listed in editsPath one after
+// another, bringing the tokens up to date with relex() after each, and
+// prints the final tokens as runBuffered() would. Diagnostics are those of
+// the first lex and then of each re-lexed region.
+int runRelex(const string& path, const string& editsPath, unsigned jobs, TokenFormat format, const string& binaryPath) {
+    SourceFile source;
+    if (!source.open(path)) {
+        cerr << "Error: Could not open file '" << path << "' (" << source.error() << ")" << endl;
+        return 1;
+    }
+    ifstream edits(editsPath);
+    if (!edits) {
+        cerr << "Error: Could not open file '" << editsPath << "'" << endl;
+        return 1;
+    }
+    // Tokens view the current text, so the edited text is built in the other
+    // string rather than moved into place
+    string texts[2] = {string(source.view()), string()};
+    int current = 0;
+    if (texts[current].size() > UINT32_MAX) {
+        cerr << "Error: '" << path << "' is 4 GiB or larger; use --stream" << endl;
+        return 1;
+    }
+
+    WorkPool pool(jobs - 1);
+    ostringstream diagnostics;
+    TokenList tokens = tokenizeCached(texts[current], pool, diagnostics);
+    cerr << diagnostics.str();
+    size_t lineNumber = 0;
+    for (string line; getline(edits, line); ) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        Edit edit;
+        string inserted;
+        const string& text = texts[current];
+        if (!parseEdit(line, edit.offset, edit.removed, inserted) || edit.offset > text.size() ||
+            edit.removed > text.size() - edit.offset || text.size() - edit.removed + inserted.size() > UINT32_MAX) {
+            cerr << "Error: Invalid edit on line " << lineNumber << " of '" << editsPath << "'" << endl;
+            return 1;
+        }
+        edit.inserted = inserted;
+        string& next = texts[1 - current];
+        next = text;
+        applyEdit(next, edit);
+        ostringstream regionDiagnostics;
+        relex(tokens, next, edit, regionDiagnostics);
+        cerr << regionDiagnostics.str();
+        diagnostics << regionDiagnostics.str();
+        current = 1 - current;
+    }
+
+    if (!binaryPath.empty()) {
+        if (!writeBinary(binaryPath, tokens, texts[current], diagnostics.str())) {
+            cerr << "Error: Could not write '" << binaryPath << "'" << endl;
+            return 1;
+        }
+        return 0;
+    }
+    TokenPrinter printer(cout, format);
+    printTokens(printer, tokens);
+    return 0;
+}
+
+// Answers one --serve request as runBuffered() would answer the same input
+// on the command line. Large inputs are split across the server's pool.
+void serveRequest(const LexRequest& request, LexReply& reply, WorkPool& pool) {
+    ostringstream diagnostics, out;
+    TokenList result = tokenizeCached(request.source, pool, diagnostics);
+    reply.diagnostics = diagnostics.str();
+    if (request.binary) {
+        writeBinary(out, result, request.source, reply.diagnostics);
+    } else {
+        TokenPrinter printer(out, request.format, {}, 64 << 10);
+        printTokens(printer, result);
+    }
+    reply.output = out.str();
+}
+
+// Serves lex requests on socketPath with `jobs` workers until interrupted.
+int runServer(const string& socketPath, unsigned jobs) {
+    LexerServer server(socketPath, jobs, [&server](const LexRequest& request, LexReply& reply) {
+        serveRequest(request, reply, server.workPool());
+    });
+    if (!server.listen()) {
+        cerr << "Error: Could not listen on '" << socketPath << "' (" << server.error() << ")" << endl;
+        return 1;
+    }
+    server.run();
+    if (!server.error().empty()) {
+        cerr << "Error: Server on '" << socketPath << "' stopped (" << server.error() << ")" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    bool streaming = false;
+    bool pipelined = false;
+    unsigned jobs = 1;
+    string path = "test_input2.txt";
+    string statsPath;
+    string batch;
+    string cacheDir;
+    string binaryPath;
+    string servePath;
+    string connectPath;
+    string editsPath;
+    TokenFormat format = TokenFormat::Text;
+    uint64_t cacheMegabytes = 1024;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--stream") streaming = true;
+        else if (arg == "--pipeline") streaming = pipelined = true;
+        else if (arg == "--utf8") lexer_utf8 = true;
+        else if (arg == "--batch" && i + 1 < argc) batch = argv[++i];
+        else if (arg == "--stats" && i + 1 < argc) statsPath = argv[++i];
+        else if (arg == "--cache" && i + 1 < argc) cacheDir = argv[++i];
+        else if (arg == "--binary" && i + 1 < argc) binaryPath = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc) servePath = argv[++i];
+        else if (arg == "--connect" && i + 1 < argc) connectPath = argv[++i];
+        else if (arg == "--relex" && i + 1 < argc) editsPath = argv[++i];
+        else if (arg == "--format" && i + 1 < argc) {
+            if (!parseTokenFormat(argv[++i], format)) {
+                cerr << "Error: Unknown format '" << argv[i] << "' (text, tsv or jsonl)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--cache-size" && i + 1 < argc) {
+            if (!parseCacheSize(argv[++i], cacheMegabytes)) {
+                cerr << "Error: Invalid --cache-size '" << argv[i] << "' (a number of MB)" << endl;
+                return 1;
+            }
+        }
+        else if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+            if (!parseJobs(argv[++i], jobs)) {
+                cerr << "Error: Invalid --jobs '" << argv[i] << "' (0 for all cores, or up to 1024)" << endl;
+                return 1;
+            }
+        }
+        else path = arg;
+    }
+    if (!connectPath.empty()) {
+        if (streaming || !batch.empty() || !servePath.empty() || !editsPath.empty() || !statsPath.empty()) {
+            cerr << "Error: --connect cannot be combined with --stream, --batch, --serve, --relex or --stats" << endl;
+            return 1;
+        }
+        // The server's own --utf8 and --cache apply
+        return runLexClient(connectPath, path, format, binaryPath);
+    }
+    if (!editsPath.empty() && (streaming || !batch.empty() || !servePath.empty())) {
+        cerr << "Error: --relex cannot be combined with --stream, --batch or --serve" << endl;
+        return 1;
+    }
+    if (!servePath.empty() && (streaming || !batch.empty() || !binaryPath.empty() || !statsPath.empty())) {
+        cerr << "Error: --serve cannot be combined with --stream, --batch, --binary or --stats" << endl;
+        return 1;
+    }
+#ifdef LEXER_STATS
+    LexerStats stats(size(token_names));
+    if (!statsPath.empty()) lexer_stats = &stats;
+#else
+    if (!statsPath.empty()) {
+        cerr << "Error: --stats needs a build with -DLEXER_STATS" << endl;
+        return 1;
+    }
+#endif
+    if (!binaryPath.empty() && (streaming || !batch.empty())) {
+        cerr << "Error: --binary cannot be combined with --stream or --batch" << endl;
+        return 1;
+    }
+    unique_ptr<TokenCache> cache;
+    if (!cacheDir.empty()) {
+        cache = make_unique<TokenCache>(cacheDir, lexer_utf8 ? "noregex-utf8" : "noregex", cacheMegabytes << 20);
+        if (!cache->error().empty()) cerr << "Warning: cache '" << cacheDir << "' not used (" << cache->error() << ")" << endl;
+        token_cache = cache.get();
+    }
+
+    int status = !servePath.empty() ? runServer(servePath, jobs)
+               : !batch.empty() ? runBatch(batch, jobs, format)
+               : !editsPath.empty() ? runRelex(path, editsPath, jobs, format, binaryPath)
+               : pipelined ? runPipelined(path, format)
+               : streaming ? runStreaming(path, format) : runBuffered(path, jobs, format, binaryPath);
+
+#ifdef LEXER_STATS
+    if (lexer_stats && !stats.save(statsPath, "noregex", token_names)) {
+        cerr << "Error: Could not write '" << statsPath << "'" << endl;
+        return 1;
+    }
+#endif
+    return status;
+
+}
@@ -1,53 +1,151 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
 #include <algorithm>
-#include <regex>
+#include <cctype>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include "regex_dfa.h"
+#include "source_file.h"
+#include "token_spec.h"
+#include "lexer_stats.h"
+#include "work_pool.h"
+#include "lexer_batch.h"
+#include "token_cache.h"
+#include "token_stream.h"
+#include "token_printer.h"
+#include "decimal_literal.h"
+#include "lexer_server.h"
 
 using namespace std;
 
 
-enum TokenType
-{
-    T_FUNCTION, T_INT, T_FLOAT, T_STRING, T_BOOL, T_RETURN, T_IDENTIFIER,
-    T_INTLIT, T_FLOATLIT, T_STRINGLIT, T_BOOLLIT, T_PARENL, T_PARENR,
-    T_BRACEL, T_BRACER, T_BRACKETL, T_BRACKETR, T_COMMA, T_SEMICOLON,
-    T_COLON, T_ASSIGNOP, T_EQUALSOP, T_NOTEQUALS, T_LESSTHAN,
-    T_GREATERTHAN, T_LESSEQUAL, T_GREATEREQUAL, T_PLUS, T_MINUS, T_MULT,
-    T_DIV, T_AND, T_OR, T_NOT, T_IF, T_ELSE, T_WHILE, T_FOR,
-    T_COMMENT, T_UNKNOWN, T_EOF, T_OUTPUTOP, T_INPUTOP
+#define TOKEN_ENUM(type) type,
+enum TokenType { REGEX_TOKEN_TYPES(TOKEN_ENUM) };
+
+#define TOKEN_NAME(type) #type,
+const char* const token_names[] = { REGEX_TOKEN_TYPES(TOKEN_NAME) };
+
+#define KEYWORD_SPELLING(text, type) {text, type},
+constexpr Spelling<TokenType> keyword_spellings[] = {
+    SHARED_KEYWORDS(KEYWORD_SPELLING) REGEX_ONLY_KEYWORDS(KEYWORD_SPELLING)
+};
+constexpr KeywordTable keyword_table(keyword_spellings);
+static_assert(keyword_table.valid(), "no perfect hash for the keyword set");
+
+#define SHARED_OPERATOR_SPELLING(text, noregexType, type) {text, type},
+constexpr Spelling<TokenType> operator_spellings[] = {
+    SHARED_OPERATORS(SHARED_OPERATOR_SPELLING) REGEX_ONLY_OPERATORS(KEYWORD_SPELLING)
 };
+constexpr OperatorTrie operator_trie(operator_spellings);
 
 
+// value views the source_code passed to Lexer::tokenize(), which must
+// outlive the returned tokens. A T_INTLIT or T_FLOATLIT also carries its
+// decoded value in number.
 struct Token
 {
     TokenType type;
-    string value;
+    string_view value;
     int line;
+    size_t offset = 0;   // Where the match starts: a string literal's opening quote
+    uint64_t number = 0; // See numberBits()
+};
+
+// What a match of each token pattern turns into.
+enum PatternKind
+{
+    P_LINE_COMMENT, P_BLOCK_COMMENT, P_UNCLOSED_COMMENT, P_STRING, P_UNCLOSED_STRING,
+    P_KEYWORD, P_IDENTIFIER, P_FLOAT, P_INT, P_OPERATOR, P_WHITESPACE, P_UNKNOWN
 };
 
+#ifdef LEXER_STATS
+// Indexed by PatternKind
+const LexerStats::ByteClass pattern_byte_classes[] = {
+    LexerStats::Comment, LexerStats::Comment, LexerStats::Comment, LexerStats::String, LexerStats::String,
+    LexerStats::Identifier, LexerStats::Identifier, LexerStats::Number, LexerStats::Number,
+    LexerStats::Operator, LexerStats::Whitespace, LexerStats::Other
+};
+static_assert(size(pattern_byte_classes) == P_UNKNOWN + 1, "one byte class per PatternKind");
+#endif
+
+struct TokenPattern
+{
+    PatternKind kind;
+    DfaPattern pattern;
+};
+
+// Matches text literally: every punctuation byte is escaped.
+string literalPattern(string_view text)
+{
+    string re;
+    for (char c : text) {
+        if (!isalnum((unsigned char)c)) re += '\\';
+        re += c;
+    }
+    return re;
+}
+
+// Tried as one alternation: the longest match wins, and earlier entries win
+// ties, so keywords come before identifiers. The keyword and operator entries
+// are generated from token_spec.h. The comment patterns spell out what the old
+// lazy \/\*[\s\S]*?\*\/ meant, since the DFA has no lazy quantifiers: a closed
+// comment cannot contain "*/", and an unclosed one stops before any "*/", so
+// it is only longest when the comment runs to end of input.
+vector<TokenPattern> buildTokenPatterns()
+{
+    vector<TokenPattern> patterns = {
+        {P_LINE_COMMENT,     {R"(\/\/.*)"}},
+        {P_BLOCK_COMMENT,    {R"(\/\*(?:[^*]|\*+[^*\/])*\*+\/)"}},
+        {P_UNCLOSED_COMMENT, {R"(\/\*(?:[^*]|\*+[^*\/])*\**)"}},
+        {P_STRING,           {R"(\"(?:\\.|[^\"\\])*\")"}},
+        {P_UNCLOSED_STRING,  {R"(\"(?:\\.|[^\"\\])*)"}},
+    };
+    string keywords;
+    for (const auto& k : keyword_spellings) {
+        if (!keywords.empty()) keywords += '|';
+        keywords += literalPattern(k.text);
+    }
+    patterns.push_back({P_KEYWORD, {keywords, true}});
+    patterns.push_back({P_IDENTIFIER, {R"([a-zA-Z_][a-zA-Z0-9_]*)"}});
+    patterns.push_back({P_FLOAT, {R"(\d+\.\d+)"}});
+    patterns.push_back({P_INT, {R"(\d+)"}});
+    for (const auto& op : operator_spellings) patterns.push_back({P_OPERATOR, {literalPattern(op.text)}});
+    patterns.push_back({P_WHITESPACE, {R"(\s+)"}});
+    patterns.push_back({P_UNKNOWN, {R"(.)"}});
+    return patterns;
+}
+
+const vector<TokenPattern> token_patterns = buildTokenPatterns();
+
+// Compiled once per process, the first time a Lexer tokenizes.
+Dfa buildTokenDfa()
+{
+    vector<DfaPattern> patterns;
+    for (const auto& p : token_patterns) patterns.push_back(p.pattern);
+    return Dfa(patterns);
+}
+
 class Lexer
 {
 private:
     vector<Token> tokens;
     vector<string> errors;
     int lineNumber = 1;
-
-    
-    unordered_map<string, TokenType> keywords = {
-        {"fn", T_FUNCTION}, {"int", T_INT}, {"float", T_FLOAT},
-        {"string", T_STRING}, {"bool", T_BOOL}, {"return", T_RETURN},
-        {"if", T_IF}, {"else", T_ELSE}, {"while", T_WHILE},
-        {"for", T_FOR}, {"true", T_BOOLLIT}, {"false", T_BOOLLIT}
-    };
+    size_t tokenStart = 0; // Offset of the match being added
+    LEXER_STATS_ONLY(LexerStats* stats = nullptr;)
 
 public:
     Lexer() = default;
 
+    LEXER_STATS_ONLY(void setStats(LexerStats* s) { stats = s; })
+
     
-    vector<Token> tokenize(const string &source_code)
+    vector<Token> tokenize(string_view source_code)
     {
         lineNumber = 1;
         tokens.clear();
@@ -55,113 +153,56 @@ public:
 
         
         
-        string token_patterns[] = {
-            R"(\/\/.*)",                                  
-            R"(\/\*[\s\S]*?\*\/)",                        
-            R"(\/\*[\s\S]*)",                             
-            R"(\"(?:\\.|[^\"\\])*\")",                     
-            R"(\"(?:\\.|[^\"\\])*)",                      
-            R"(\b(fn|int|float|string|bool|return|if|else|while|for|true|false)\b)", 
-            R"([a-zA-Z_][a-zA-Z0-9_]*)",                  
-            R"(\d+\.\d+)",                                
-            R"(\d+)",                                     
-            R"(<<)",                                      
-            R"(>>)",                                      
-            R"(!=)",                                      
-            R"(==)",                                      
-            R"(<=)",                                      
-            R"(>=)",                                      
-            R"(&&)",                                      
-            R"(\|\|)",                                      
-            R"(\()", R"(\))", R"(\{)", R"(\})", R"(\[)", R"(\])", 
-            R"(,)", R"(;)", R"(:)",                                      
-            R"(\+)", R"(-)", R"(\*)", R"(\/)", R"(=)", R"(<)", R"(>)", R"(!)", 
-            R"(\s+)",                                     
-            R"(.)"                                        
-        };
-
-        
-        string regex_str;
-        for (const auto& p : token_patterns) {
-            if (!regex_str.empty()) regex_str += "|";
-            regex_str += "(" + p + ")";
-        }
-
-        regex master_regex(regex_str);
-        auto words_begin = sregex_iterator(source_code.begin(), source_code.end(), master_regex);
-        auto words_end = sregex_iterator();
-
-        for (sregex_iterator i = words_begin; i != words_end; ++i) {
-            smatch match = *i;
-            string match_str = match.str();
-
-            size_t group_idx = 0;
-            for (size_t j = 1; j < match.size(); ++j) {
-                if (match[j].matched) {
-                    group_idx = j;
-                    break;
-                }
+        static const Dfa dfa = buildTokenDfa();
+        size_t pos = 0;
+        while (pos < source_code.size()) {
+            unsigned char prev = pos > 0 ? (unsigned char)source_code[pos - 1] : ' ';
+            Dfa::Match match = dfa.longestMatch(source_code.data() + pos, source_code.size() - pos,
+                                                isalnum(prev) || prev == '_');
+            if (match.pattern < 0) { // std::regex skipped bytes no pattern matched
+                pos++;
+                continue;
             }
+            string_view match_str = source_code.substr(pos, match.length);
+            tokenStart = pos;
+            pos += match.length;
+            PatternKind kind = token_patterns[match.pattern].kind;
+            LEXER_STATS_ONLY(if (stats) stats->bytes[pattern_byte_classes[kind]] += match.length;)
+
             
-            
-            if (group_idx == 1 || group_idx == 2) { 
+            if (kind == P_LINE_COMMENT || kind == P_BLOCK_COMMENT) { 
                 
                 lineNumber += count(match_str.begin(), match_str.end(), '\n');
-            } else if (group_idx == 3) { 
+            } else if (kind == P_UNCLOSED_COMMENT) { 
                  errors.push_back("Error: Unclosed multi-line comment starting at line " + to_string(lineNumber));
                  lineNumber += count(match_str.begin(), match_str.end(), '\n');
-            } else if (group_idx == 4) { 
+            } else if (kind == P_STRING) { 
                 add_token(T_STRINGLIT, match_str.substr(1, match_str.length() - 2));
                 lineNumber += count(match_str.begin(), match_str.end(), '\n');
-            } else if (group_idx == 5) { 
+            } else if (kind == P_UNCLOSED_STRING) { 
                  errors.push_back("Error: Unclosed string literal starting at line " + to_string(lineNumber));
                  lineNumber += count(match_str.begin(), match_str.end(), '\n');
-            } else if (group_idx == 6) { 
-                add_token(keywords[match_str], match_str);
-            } else if (group_idx == 7) { 
+            } else if (kind == P_KEYWORD) { 
+                add_token(*keyword_table.find(match_str), match_str);
+            } else if (kind == P_IDENTIFIER) { 
                 add_token(T_IDENTIFIER, match_str);
-            } else if (group_idx == 8) { 
-                add_token(T_FLOATLIT, match_str);
-            } else if (group_idx == 9) { 
-                add_token(T_INTLIT, match_str);
-            } else if (group_idx >= 10 && group_idx <= 29) { 
-                
-                TokenType type = T_UNKNOWN;
-                if (match_str == "<<") type = T_OUTPUTOP;
-                else if (match_str == ">>") type = T_INPUTOP;
-                else if (match_str == "!=") type = T_NOTEQUALS;
-                else if (match_str == "==") type = T_EQUALSOP;
-                else if (match_str == "<=") type = T_LESSEQUAL;
-                else if (match_str == ">=") type = T_GREATEREQUAL;
-                else if (match_str == "&&") type = T_AND;
-                else if (match_str == "||") type = T_OR;
-                else if (match_str == "(") type = T_PARENL;
-                else if (match_str == ")") type = T_PARENR;
-                else if (match_str == "{") type = T_BRACEL;
-                else if (match_str == "}") type = T_BRACER;
-                else if (match_str == "[") type = T_BRACKETL;
-                else if (match_str == "]") type = T_BRACKETR;
-                else if (match_str == ",") type = T_COMMA;
-                else if (match_str == ";") type = T_SEMICOLON;
-                else if (match_str == ":") type = T_COLON;
-                else if (match_str == "+") type = T_PLUS;
-                else if (match_str == "-") type = T_MINUS;
-                else if (match_str == "*") type = T_MULT;
-                else if (match_str == "/") type = T_DIV;
-                else if (match_str == "=") type = T_ASSIGNOP;
-                else if (match_str == "<") type = T_LESSTHAN;
-                else if (match_str == ">") type = T_GREATERTHAN;
-                else if (match_str == "!") type = T_NOT;
-                add_token(type, match_str);
-            } else if (group_idx == 30) { 
+            } else if (kind == P_FLOAT) { 
+                add_number(T_FLOATLIT, match_str);
+            } else if (kind == P_INT) { 
+                add_number(T_INTLIT, match_str);
+            } else if (kind == P_OPERATOR) { 
+                add_token(*operator_trie.exact(match_str), match_str);
+            } else if (kind == P_WHITESPACE) { 
                  lineNumber += count(match_str.begin(), match_str.end(), '\n');
-            } else if (group_idx == 31) { 
-                errors.push_back("Warning at line " + to_string(lineNumber) + ": Unknown character '" + match_str + "'");
+            } else if (kind == P_UNKNOWN) { 
+                errors.push_back("Warning at line " + to_string(lineNumber) + ": Unknown character '" + string(match_str) + "'");
                 add_token(T_UNKNOWN, match_str);
             }
         }
 
-        tokens.push_back({T_EOF, "", lineNumber});
+        tokenStart = source_code.size();
+        add_token(T_EOF, "");
+        LEXER_STATS_ONLY(if (stats) stats->errors += errors.size();)
         return tokens;
     }
 
@@ -171,67 +212,323 @@ public:
 
 private:
     
-    void add_token(TokenType type, const string& value) {
-        tokens.push_back({type, value, lineNumber});
+    void add_token(TokenType type, string_view value) {
+        LEXER_STATS_ONLY(if (stats) stats->tokens[type]++;)
+        tokens.push_back({type, value, lineNumber, tokenStart});
+    }
+
+    // A numeric literal with its decoded value; one out of range is reported
+    // and keeps its type, valued INT64_MAX, infinity or 0.
+    void add_number(TokenType type, string_view value) {
+        add_token(type, value);
+        if (!DecimalLiteral::decode(value, type == T_FLOATLIT, tokens.back().number)) {
+            errors.push_back("Error: " + string(type == T_INTLIT ? "Integer" : "Float") + " literal '" + string(value) +
+                             "' out of range at line " + to_string(lineNumber));
+        }
     }
 };
 
+// The --cache directory, if one was given.
+TokenCache* token_cache = nullptr;
+
+// Tokens are stored as the offset where each starts in source and where
+// its value, which views source, starts relative to that; numeric literals
+// are followed by their decoded value.
+void saveTokens(string& payload, string_view source, const vector<Token>& tokens, const vector<string>& errors)
+{
+    ByteWriter out(payload);
+    out.put<uint64_t>(errors.size());
+    for (const string& e : errors) out.putString(e);
+    out.put<uint64_t>(tokens.size());
+    for (const Token& t : tokens) {
+        out.put<uint8_t>((uint8_t)t.type);
+        out.put<int32_t>(t.line);
+        out.put<uint32_t>((uint32_t)t.offset);
+        out.put<uint32_t>(t.value.empty() ? 0 : (uint32_t)(t.value.data() - source.data() - t.offset));
+        out.put<uint32_t>((uint32_t)t.value.size());
+        if (t.type == T_INTLIT || t.type == T_FLOATLIT) out.put<uint64_t>(t.number);
+    }
+}
 
-string tokenTypeToString(TokenType type);
+bool loadTokens(string_view payload, string_view source, vector<Token>& tokens, vector<string>& errors)
+{
+    ByteReader in(payload);
+    uint64_t count;
+    if (!in.get(count)) return false;
+    errors.resize(count);
+    for (string& e : errors) {
+        if (!in.getString(e)) return false;
+    }
+    if (!in.get(count)) return false;
+    for (uint64_t k = 0; k < count; k++) {
+        uint8_t type;
+        int32_t line;
+        uint32_t offset, skip, length;
+        if (!in.get(type) || !in.get(line) || !in.get(offset) || !in.get(skip) || !in.get(length)) return false;
+        if (type >= size(token_names) || (uint64_t)offset + skip + length > source.size()) return false;
+        tokens.push_back({(TokenType)type, source.substr(offset + skip, length), line, offset});
+        if ((type == T_INTLIT || type == T_FLOATLIT) && !in.get(tokens.back().number)) return false;
+    }
+    return in.atEnd();
+}
 
-int main()
+// Writes tokens as a binary token stream to out.
+bool writeBinary(ostream& out, string_view source, const vector<Token>& tokens, const vector<string>& errors)
 {
-    ifstream file("test_input.txt");
-    if (!file) {
-        cerr << "Error: Could not open test_input.txt" << endl;
-        return 1;
+    TokenStreamWriter writer("regex", token_names, size(token_names), source);
+    for (const Token& t : tokens) {
+        writer.add(t.type, t.value, t.offset, t.number);
     }
+    string diagnostics;
+    for (const string& e : errors) diagnostics += e + "\n";
+    writer.setDiagnostics(diagnostics);
+    return writer.write(out);
+}
 
-    string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
+// As above, to path ("-" for stdout).
+bool writeBinary(const string& path, string_view source, const vector<Token>& tokens, const vector<string>& errors)
+{
+    if (path == "-") return writeBinary(cout, source, tokens, errors);
+    ofstream file(path, ios::binary | ios::trunc);
+    return file && writeBinary(file, source, tokens, errors);
+}
 
+// Lexes source, or loads its tokens and errors from token_cache if it is set
+// and has them.
+void lexCached(string_view source, vector<Token>& tokens, vector<string>& errors LEXER_STATS_ONLY(, LexerStats* statsSink))
+{
+    string payload;
+    if (token_cache && token_cache->load(source, payload) && loadTokens(payload, source, tokens, errors)) return;
     Lexer lexer;
-    vector<Token> tokens = lexer.tokenize(source);
+    LEXER_STATS_ONLY(lexer.setStats(statsSink);)
+    tokens = lexer.tokenize(source);
+    errors = lexer.getErrors();
+    if (token_cache) {
+        payload.clear();
+        saveTokens(payload, source, tokens, errors);
+        token_cache->store(source, payload);
+    }
+}
 
-    
-    const auto& errors = lexer.getErrors();
-    if (!errors.empty()) {
-        cerr << "Lexical analysis failed with " << errors.size() << " errors:" << endl;
-        for (const string& err : errors) {
-            cerr << err << endl;
+void reportErrors(ostream& err, const vector<string>& errors)
+{
+    if (errors.empty()) return;
+    err << "Lexical analysis failed with " << errors.size() << " errors:" << endl;
+    for (const string& e : errors) {
+        err << e << endl;
+    }
+}
+
+// Prints tokens in the printer's format, text under header.
+void printTokens(TokenPrinter& printer, const string& header, const vector<Token>& tokens)
+{
+    TokenFormat format = printer.format();
+    if (format == TokenFormat::Text) {
+        printer.write(header);
+        printer.write('\n');
+    }
+    for (const auto &token : tokens) {
+        if (token.type == T_EOF) break;
+        if (format != TokenFormat::Text) {
+            printer.record(token_names[token.type], token.value, token.line);
+            continue;
         }
+        printer.write('<');
+        printer.write(token_names[token.type]);
+        printer.write(", \"");
+        printer.write(token.value);
+        printer.write("\", line ");
+        printer.writeNumber(token.line);
+        printer.write(">\n");
     }
+}
+
+// Lexes the file at path, writing its errors to err and its token stream to
+// out in format (under header if that is text; a tsv or jsonl record names
+// file if that is set), or as a binary stream to binaryPath if that is set.
+// False if the file cannot be read or the stream cannot be written.
+bool lexFile(const string& path, const string& header, const string& file, TokenFormat format,
+             const string& binaryPath, ostream& out, ostream& err LEXER_STATS_ONLY(, LexerStats* statsSink))
+{
+    LEXER_STATS_ONLY(PhaseTimer readTimer(statsSink, LexerStats::Read);)
+    SourceFile source;
+    if (!source.open(path)) {
+        err << "Error: Could not open " << path << " (" << source.error() << ")" << endl;
+        return false;
+    }
+    LEXER_STATS_ONLY(readTimer.stop();)
+
+    LEXER_STATS_ONLY(PhaseTimer lexTimer(statsSink, LexerStats::Lex);)
+    vector<Token> tokens;
+    vector<string> errors;
+    lexCached(source.view(), tokens, errors LEXER_STATS_ONLY(, statsSink));
+    LEXER_STATS_ONLY(lexTimer.stop();)
+
+    LEXER_STATS_ONLY(PhaseTimer emitTimer(statsSink, LexerStats::Emit);)
+
     
+    reportErrors(err, errors);
     
-    cout << "Token stream:" << endl;
-    for (const auto &token : tokens) {
-        if (token.type == T_EOF) break;
-        cout << "<" << tokenTypeToString(token.type) << ", \"" << token.value << "\", line " << token.line << ">" << endl;
+    
+    if (!binaryPath.empty()) {
+        if (writeBinary(binaryPath, source.view(), tokens, errors)) return true;
+        err << "Error: Could not write '" << binaryPath << "'" << endl;
+        return false;
+    }
+    TokenPrinter printer(out, format, file, 64 << 10);
+    printTokens(printer, header, tokens);
+    return true;
+}
+
+// Lexes every file named by spec (see collectBatchInputs) on `jobs` threads
+// and prints their token streams one after another in input order.
+int runBatch(const string& spec, unsigned jobs, TokenFormat format LEXER_STATS_ONLY(, LexerStats* statsSink))
+{
+    vector<string> paths;
+    string error;
+    if (!collectBatchInputs(spec, paths, error)) {
+        cerr << "Error: Could not read batch input '" << spec << "' (" << error << ")" << endl;
+        return 1;
+    }
+
+    WorkPool pool(jobs - 1);
+    LEXER_STATS_ONLY(mutex statsMutex;)
+    return lexBatch(paths, pool, [&](const string& path, BatchOutput& result) {
+        ostringstream out, err;
+#ifdef LEXER_STATS
+        LexerStats fileStats(size(token_names));
+        result.ok = lexFile(path, "Token stream: " + path, path, format, "", out, err, statsSink ? &fileStats : nullptr);
+        if (statsSink) {
+            lock_guard<mutex> lock(statsMutex);
+            statsSink->merge(fileStats);
+        }
+#else
+        result.ok = lexFile(path, "Token stream: " + path, path, format, "", out, err);
+#endif
+        result.tokens = out.str();
+        result.diagnostics = err.str();
+    });
+}
+
+// Answers one --serve request as lexFile() would answer the same input on
+// the command line.
+void serveRequest(const LexRequest& request, LexReply& reply)
+{
+    vector<Token> tokens;
+    vector<string> errors;
+    lexCached(request.source, tokens, errors LEXER_STATS_ONLY(, nullptr));
+    ostringstream out, err;
+    reportErrors(err, errors);
+    if (request.binary) {
+        writeBinary(out, request.source, tokens, errors);
+    }
+    else {
+        TokenPrinter printer(out, request.format, "", 64 << 10);
+        printTokens(printer, "Token stream:", tokens);
     }
+    reply.output = out.str();
+    reply.diagnostics = err.str();
+}
 
+// Serves lex requests on socketPath with `jobs` workers until interrupted.
+int runServer(const string& socketPath, unsigned jobs)
+{
+    Lexer().tokenize(""); // Builds the DFA now rather than on the first request
+    LexerServer server(socketPath, jobs, serveRequest);
+    if (!server.listen()) {
+        cerr << "Error: Could not listen on '" << socketPath << "' (" << server.error() << ")" << endl;
+        return 1;
+    }
+    server.run();
+    if (!server.error().empty()) {
+        cerr << "Error: Server on '" << socketPath << "' stopped (" << server.error() << ")" << endl;
+        return 1;
+    }
     return 0;
 }
 
+int main(int argc, char* argv[])
+{
+    string path = "test_input.txt";
+    string statsPath;
+    string batch;
+    string cacheDir;
+    string binaryPath;
+    string servePath;
+    string connectPath;
+    TokenFormat format = TokenFormat::Text;
+    uint64_t cacheMegabytes = 1024;
+    unsigned jobs = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--stats" && i + 1 < argc) statsPath = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc) batch = argv[++i];
+        else if (arg == "--cache" && i + 1 < argc) cacheDir = argv[++i];
+        else if (arg == "--binary" && i + 1 < argc) binaryPath = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc) servePath = argv[++i];
+        else if (arg == "--connect" && i + 1 < argc) connectPath = argv[++i];
+        else if (arg == "--format" && i + 1 < argc) {
+            if (!parseTokenFormat(argv[++i], format)) {
+                cerr << "Error: Unknown format '" << argv[i] << "' (text, tsv or jsonl)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--cache-size" && i + 1 < argc) {
+            if (!parseCacheSize(argv[++i], cacheMegabytes)) {
+                cerr << "Error: Invalid --cache-size '" << argv[i] << "' (a number of MB)" << endl;
+                return 1;
+            }
+        }
+        else if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+            if (!parseJobs(argv[++i], jobs)) {
+                cerr << "Error: Invalid --jobs '" << argv[i] << "' (0 for all cores, or up to 1024)" << endl;
+                return 1;
+            }
+        }
+        else path = arg;
+    }
+    if (!connectPath.empty()) {
+        if (!batch.empty() || !servePath.empty() || !statsPath.empty()) {
+            cerr << "Error: --connect cannot be combined with --batch, --serve or --stats" << endl;
+            return 1;
+        }
+        return runLexClient(connectPath, path, format, binaryPath);
+    }
+    if (!servePath.empty() && (!batch.empty() || !binaryPath.empty() || !statsPath.empty())) {
+        cerr << "Error: --serve cannot be combined with --batch, --binary or --stats" << endl;
+        return 1;
+    }
+#ifdef LEXER_STATS
+    LexerStats stats(size(token_names));
+    LexerStats* statsSink = statsPath.empty() ? nullptr : &stats;
+#else
+    if (!statsPath.empty()) {
+        cerr << "Error: --stats needs a build with -DLEXER_STATS" << endl;
+        return 1;
+    }
+#endif
+    if (!binaryPath.empty() && !batch.empty()) {
+        cerr << "Error: --binary cannot be combined with --batch" << endl;
+        return 1;
+    }
+    unique_ptr<TokenCache> cache;
+    if (!cacheDir.empty()) {
+        cache = make_unique<TokenCache>(cacheDir, "regex", cacheMegabytes << 20);
+        if (!cache->error().empty()) cerr << "Warning: cache '" << cacheDir << "' not used (" << cache->error() << ")" << endl;
+        token_cache = cache.get();
+    }
+
+    int status;
+    if (!servePath.empty()) status = runServer(servePath, jobs);
+    else if (!batch.empty()) status = runBatch(batch, jobs, format LEXER_STATS_ONLY(, statsSink));
+    else status = lexFile(path, "Token stream:", "", format, binaryPath, cout, cerr LEXER_STATS_ONLY(, statsSink)) ? 0 : 1;
 
-string tokenTypeToString(TokenType type) {
-    static const unordered_map<TokenType, string> typeMap = {
-        {T_FUNCTION, "T_FUNCTION"}, {T_INT, "T_INT"}, {T_FLOAT, "T_FLOAT"},
-        {T_STRING, "T_STRING"}, {T_BOOL, "T_BOOL"}, {T_RETURN, "T_RETURN"},
-        {T_IDENTIFIER, "T_IDENTIFIER"}, {T_INTLIT, "T_INTLIT"}, {T_FLOATLIT, "T_FLOATLIT"},
-        {T_STRINGLIT, "T_STRINGLIT"}, {T_BOOLLIT, "T_BOOLLIT"}, {T_PARENL, "T_PARENL"},
-        {T_PARENR, "T_PARENR"}, {T_BRACEL, "T_BRACEL"}, {T_BRACER, "T_BRACER"},
-        {T_BRACKETL, "T_BRACKETL"}, {T_BRACKETR, "T_BRACKETR"}, {T_COMMA, "T_COMMA"},
-        {T_SEMICOLON, "T_SEMICOLON"}, {T_COLON, "T_COLON"}, {T_ASSIGNOP, "T_ASSIGNOP"},
-        {T_EQUALSOP, "T_EQUALSOP"}, {T_NOTEQUALS, "T_NOTEQUALS"}, {T_LESSTHAN, "T_LESSTHAN"},
-        {T_GREATERTHAN, "T_GREATERTHAN"}, {T_LESSEQUAL, "T_LESSEQUAL"}, {T_GREATEREQUAL, "T_GREATEREQUAL"},
-        {T_PLUS, "T_PLUS"}, {T_MINUS, "T_MINUS"}, {T_MULT, "T_MULT"}, {T_DIV, "T_DIV"},
-        {T_AND, "T_AND"}, {T_OR, "T_OR"}, {T_NOT, "T_NOT"}, {T_IF, "T_IF"},
-        {T_ELSE, "T_ELSE"}, {T_WHILE, "T_WHILE"}, {T_FOR, "T_FOR"}, {T_COMMENT, "T_COMMENT"},
-        {T_UNKNOWN, "T_UNKNOWN"}, {T_EOF, "T_EOF"}, {T_OUTPUTOP, "T_OUTPUTOP"}, {T_INPUTOP, "T_INPUTOP"}
-    };
-    auto it = typeMap.find(type);
-    if (it != typeMap.end()) {
-        return it->second;
+#ifdef LEXER_STATS
+    if (statsSink && !stats.save(statsPath, "regex", token_names)) {
+        cerr << "Error: Could not write '" << statsPath << "'" << endl;
+        return 1;
     }
-    return "UNKNOWN_TOKEN_TYPE";
-}   
\ No newline at end of file
+#endif
+    return status;
+}
+
@@ -0,0 +1,598 @@
+#ifndef LEXER_SERVER_H
+#define LEXER_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "source_file.h"
+#include "token_printer.h"
+#include "work_pool.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// ---- Server mode (--serve SOCKET, --connect SOCKET) ----
+//
+// A lexer started with --serve stays up and lexes requests sent over a local
+// (Unix domain) stream socket, so tooling that lexes many small snippets pays
+// for process start-up and table or DFA construction once rather than per
+// snippet. A connection carries any number of requests, one after another;
+// each is answered before the next is read.
+//
+// Both directions use host byte order, the socket being local:
+//
+//     request  char magic[4] = "LXRQ"
+//              uint32_t format     0 text, 1 tsv, 2 jsonl, 3 binary stream
+//              uint64_t length
+//              char     source[length]
+//     reply    char magic[4] = "LXRP"
+//              uint32_t status     The exit status the CLI would have returned
+//              uint64_t outputLength, diagnosticsLength
+//              char     output[outputLength]            What it would print on stdout
+//              char     diagnostics[diagnosticsLength]  ... and on stderr
+//
+// A request the server cannot parse gets a reply with status 2 and says why
+// in its diagnostics, and the connection is then closed.
+
+struct LexRequest
+{
+    TokenFormat format = TokenFormat::Text;
+    bool binary = false; // A binary token stream (token_stream.h) instead of format
+    std::string_view source;
+};
+
+struct LexReply
+{
+    int status = 0;
+    std::string output;
+    std::string diagnostics;
+};
+
+namespace lexer_server_detail {
+
+struct RequestHeader
+{
+    char magic[4] = {'L', 'X', 'R', 'Q'};
+    uint32_t format = 0;
+    uint64_t length = 0;
+};
+
+struct ReplyHeader
+{
+    char magic[4] = {'L', 'X', 'R', 'P'};
+    uint32_t status = 0;
+    uint64_t outputLength = 0;
+    uint64_t diagnosticsLength = 0;
+};
+
+constexpr uint32_t BinaryFormat = 3;
+constexpr uint64_t MaxRequestBytes = 256 << 20;
+constexpr size_t MaxIdleBuffer = 1 << 20; // An idle connection keeps no more than this
+constexpr int ReplyTimeoutMs = 10000;
+
+// Why the server will not lex a request with this header; empty if it will.
+inline std::string refusal(const RequestHeader& header)
+{
+    if (std::memcmp(header.magic, RequestHeader().magic, sizeof header.magic) != 0) return "Not a lex request";
+    if (header.format > BinaryFormat) return "Unknown format " + std::to_string(header.format);
+    if (header.length > MaxRequestBytes) {
+        return "Request of " + std::to_string(header.length) + " bytes is over the limit of " +
+               std::to_string(MaxRequestBytes);
+    }
+    return std::string();
+}
+
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+constexpr int SendFlags = MSG_NOSIGNAL; // A client gone away is an error, not SIGPIPE
+#else
+constexpr int SendFlags = 0;
+#endif
+
+// Reads exactly n bytes; false on an error or end of input.
+inline bool readFully(int fd, void* buffer, size_t n)
+{
+    for (size_t got = 0; got < n; ) {
+        ssize_t r = ::read(fd, static_cast<char*>(buffer) + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        got += (size_t)r;
+    }
+    return true;
+}
+
+// Writes every byte of iov[0, count), in as few system calls as the socket
+// allows. On a non-blocking socket it waits for room at most timeoutMs in
+// all, so a peer that reads slowly cannot hold the caller for long. Advances
+// iov past what was sent.
+inline bool sendAll(int fd, iovec* iov, int count, int timeoutMs = -1)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (count > 0) {
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = (decltype(message.msg_iovlen))count;
+        ssize_t n = ::sendmsg(fd, &message, SendFlags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) return false;
+            pollfd room = {fd, POLLOUT, 0};
+            ::poll(&room, 1, (int)left.count());
+            continue;
+        }
+        if (n < 0) return false;
+        size_t sent = (size_t)n;
+        for (; count > 0 && sent >= iov->iov_len; count--, iov++) sent -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+inline bool setAddress(const std::string& path, sockaddr_un& address, std::string& error)
+{
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof address.sun_path) {
+        error = "socket path is empty or too long";
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+#endif
+
+} // namespace lexer_server_detail
+
+// Serves lex requests with a handler on a pool of worker threads. A poll()
+// loop on the calling thread accepts connections and reads each request as
+// its bytes arrive, without blocking; only a connection with a whole request
+// in is handed to a worker, which answers it, and any further requests
+// already complete on it, before handing it back. Workers never wait for a
+// client to send, so a client that stalls mid-request ties up nothing but
+// its own connection, and one that will not read its reply is dropped after
+// ten seconds. The handler runs on several threads at once.
+class LexerServer
+{
+public:
+    using Handler = std::function<void(const LexRequest&, LexReply&)>;
+
+    LexerServer(std::string socketPath, unsigned workers, Handler handler)
+        : path(std::move(socketPath)), workerCount(std::max(1u, workers)), handler(std::move(handler))
+    {
+    }
+
+    LexerServer(const LexerServer&) = delete;
+    LexerServer& operator=(const LexerServer&) = delete;
+
+    ~LexerServer() { shutdown(); }
+
+    // Creates and binds the socket. A socket file left behind by a server
+    // that is no longer running is replaced; one that still answers is not,
+    // and nor is anything at the path that is not a socket.
+    bool listen();
+
+    // Serves until stop() is called or the process gets SIGINT or SIGTERM,
+    // then finishes the requests in progress and removes the socket file.
+    void run();
+
+    // Safe to call from any thread and from a signal handler.
+    void stop()
+    {
+        stopping = true;
+#ifndef _WIN32
+        char byte = 0;
+        if (wakeWrite >= 0) (void)!::write(wakeWrite, &byte, 1);
+#endif
+    }
+
+    // The pool requests run on, for a handler that wants to split up a large
+    // request.
+    WorkPool& workPool() { return *pool; }
+
+    const std::string& error() const { return errorText; }
+
+private:
+    std::string path;
+    unsigned workerCount;
+    Handler handler;
+    std::unique_ptr<WorkPool> pool;
+    int listenFd = -1;
+    int wakeRead = -1, wakeWrite = -1; // Workers and stop() wake the poll loop through this pipe
+    bool bound = false;
+    std::atomic<bool> stopping{false};
+
+    // A client connection and what has arrived of its next request
+    struct Connection
+    {
+        int fd;
+        std::string input;    // The request's header, then its source
+        size_t filled = 0;    // Bytes of input read so far
+        size_t expected = 0;  // Bytes in the whole request, as far as is known
+        bool headerIn = false;
+
+        explicit Connection(int fd) : fd(fd) { next(); }
+        ~Connection()
+        {
+#ifndef _WIN32
+            ::close(fd);
+#endif
+        }
+
+        void next()
+        {
+            filled = 0;
+            expected = sizeof(lexer_server_detail::RequestHeader);
+            headerIn = false;
+            if (input.size() > lexer_server_detail::MaxIdleBuffer) input = std::string();
+        }
+    };
+    enum class Received { Partial, Request, Closed };
+
+    std::mutex returnedMutex;
+    std::vector<std::unique_ptr<Connection>> returned; // Connections workers are done with
+    bool closing = false;                              // Under returnedMutex: close them instead
+    std::vector<std::unique_ptr<Connection>> idle;
+    std::string errorText;
+
+    bool fail(std::string why)
+    {
+        errorText = std::move(why);
+        return false;
+    }
+
+    static LexerServer*& signalTarget()
+    {
+        static LexerServer* server = nullptr;
+        return server;
+    }
+
+    Received receive(Connection& c);
+    void serveConnection(std::unique_ptr<Connection> c);
+    bool serveOne(Connection& c, LexReply& reply);
+    void giveBack(std::unique_ptr<Connection> c);
+    void shutdown();
+};
+
+// One connection to a LexerServer, for any number of requests.
+class LexerClient
+{
+public:
+    LexerClient() = default;
+    LexerClient(const LexerClient&) = delete;
+    LexerClient& operator=(const LexerClient&) = delete;
+
+    ~LexerClient()
+    {
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+
+    bool connect(const std::string& socketPath);
+
+    // Sends request and waits for its reply. False if the server could not
+    // be reached or the connection broke; error() says why.
+    bool lex(const LexRequest& request, LexReply& reply);
+
+    const std::string& error() const { return errorText; }
+
+private:
+    int fd = -1;
+    std::string errorText;
+
+    bool fail(std::string why)
+    {
+        errorText = std::move(why);
+        return false;
+    }
+};
+
+#ifdef _WIN32
+
+inline bool LexerServer::listen() { return fail("Unix domain sockets are not supported on this platform"); }
+inline void LexerServer::run() {}
+inline void LexerServer::shutdown() {}
+inline bool LexerClient::connect(const std::string&) { return fail("Unix domain sockets are not supported on this platform"); }
+inline bool LexerClient::lex(const LexRequest&, LexReply&) { return fail("not connected"); }
+
+#else
+
+inline bool LexerServer::listen()
+{
+    using namespace lexer_server_detail;
+    sockaddr_un address;
+    if (!setAddress(path, address, errorText)) return false;
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) return fail(std::strerror(errno));
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0) {
+        if (errno != EADDRINUSE) return fail(std::strerror(errno));
+        // Only a stale socket refuses connections
+        int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof address) == 0;
+        bool stale = !live && errno == ECONNREFUSED;
+        if (probe >= 0) ::close(probe);
+        if (!stale) return fail(live ? "another server is listening there" : std::strerror(EADDRINUSE));
+        struct stat info;
+        if (::lstat(path.c_str(), &info) < 0) return fail(std::strerror(errno));
+        if (!S_ISSOCK(info.st_mode)) return fail("the path exists and is not a socket");
+        ::unlink(path.c_str());
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0) return fail(std::strerror(errno));
+    }
+    bound = true;
+    if (::listen(listenFd, SOMAXCONN) < 0) return fail(std::strerror(errno));
+    ::fcntl(listenFd, F_SETFL, ::fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    int pipeFds[2];
+    if (::pipe(pipeFds) < 0) return fail(std::strerror(errno));
+    wakeRead = pipeFds[0];
+    wakeWrite = pipeFds[1];
+    ::fcntl(wakeRead, F_SETFL, ::fcntl(wakeRead, F_GETFL) | O_NONBLOCK);
+    ::fcntl(wakeWrite, F_SETFL, ::fcntl(wakeWrite, F_GETFL) | O_NONBLOCK);
+    pool = std::make_unique<WorkPool>(workerCount);
+    return true;
+}
+
+inline void LexerServer::run()
+{
+    signalTarget() = this;
+    auto onSignal = [](int) {
+        if (LexerServer* server = signalTarget()) server->stop();
+    };
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::vector<pollfd> fds;
+    while (!stopping) {
+        fds.clear();
+        fds.push_back({wakeRead, POLLIN, 0});
+        fds.push_back({listenFd, POLLIN, 0});
+        for (const auto& c : idle) fds.push_back({c->fd, POLLIN, 0});
+        if (::poll(fds.data(), (nfds_t)fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            errorText = std::strerror(errno);
+            break;
+        }
+
+        // Read what has arrived; connections with a whole request go to the pool
+        size_t kept = 0;
+        for (size_t k = 0; k < idle.size(); k++) {
+            Received got = fds[k + 2].revents ? receive(*idle[k]) : Received::Partial;
+            if (got == Received::Request) {
+                Connection* c = idle[k].release();
+                pool->submit([this, c] { serveConnection(std::unique_ptr<Connection>(c)); });
+            }
+            else if (got == Received::Partial) idle[kept++] = std::move(idle[k]);
+        }
+        idle.resize(kept);
+
+        if (fds[0].revents) {
+            char drain[64];
+            while (::read(wakeRead, drain, sizeof drain) > 0) {}
+            std::lock_guard<std::mutex> lock(returnedMutex);
+            for (auto& c : returned) idle.push_back(std::move(c));
+            returned.clear();
+        }
+        if (fds[1].revents) {
+            while (true) {
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if (fd < 0) break;
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+                idle.push_back(std::make_unique<Connection>(fd));
+            }
+        }
+    }
+    shutdown();
+    signalTarget() = nullptr;
+}
+
+// Reads what the client has sent of its request so far, without blocking.
+// A header the server will refuse counts as a whole request, so that the
+// refusal is sent; Closed means the client has gone.
+inline LexerServer::Received LexerServer::receive(Connection& c)
+{
+    using namespace lexer_server_detail;
+    while (true) {
+        if (c.filled == c.expected) {
+            if (c.headerIn) return Received::Request;
+            c.headerIn = true;
+            RequestHeader header;
+            std::memcpy(&header, c.input.data(), sizeof header);
+            if (!refusal(header).empty()) return Received::Request;
+            c.expected += header.length;
+            continue;
+        }
+        // Grow the buffer with what arrives, not to the length the header claims
+        if (c.filled == c.input.size()) {
+            c.input.resize(std::min(c.expected, std::max(c.input.size() * 2, (size_t)64 << 10)));
+        }
+        size_t want = std::min(c.input.size(), c.expected) - c.filled;
+        ssize_t r = ::read(c.fd, &c.input[c.filled], want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return Received::Partial;
+        if (r <= 0) return Received::Closed;
+        c.filled += (size_t)r;
+    }
+}
+
+// Answers the request read on c, and any more that have arrived whole behind
+// it, then hands c back to the poll loop, or closes it once the client has
+// gone or sent something unreadable.
+inline void LexerServer::serveConnection(std::unique_ptr<Connection> c)
+{
+    static thread_local LexReply reply; // Kept per worker, so it grows to the largest reply once
+    while (true) {
+        if (!serveOne(*c, reply)) return;
+        if (stopping) break;
+        Received next = receive(*c);
+        if (next == Received::Closed) return;
+        if (next == Received::Partial) break;
+    }
+    giveBack(std::move(c));
+}
+
+inline bool LexerServer::serveOne(Connection& c, LexReply& reply)
+{
+    using namespace lexer_server_detail;
+    RequestHeader header;
+    std::memcpy(&header, c.input.data(), sizeof header);
+    reply.status = 0;
+    reply.output.clear();
+    reply.diagnostics.clear();
+    std::string refused = refusal(header);
+    if (!refused.empty()) {
+        reply.status = 2;
+        reply.diagnostics = "Error: " + refused + "\n";
+    }
+    else {
+        LexRequest request;
+        request.binary = header.format == BinaryFormat;
+        if (!request.binary) request.format = (TokenFormat)header.format;
+        request.source = std::string_view(c.input).substr(sizeof header, header.length);
+        handler(request, reply);
+    }
+    c.next();
+
+    ReplyHeader out;
+    out.status = (uint32_t)reply.status;
+    out.outputLength = reply.output.size();
+    out.diagnosticsLength = reply.diagnostics.size();
+    iovec iov[3] = {{&out, sizeof out},
+                    {&reply.output[0], reply.output.size()},
+                    {&reply.diagnostics[0], reply.diagnostics.size()}};
+    return sendAll(c.fd, iov, 3, ReplyTimeoutMs) && refused.empty();
+}
+
+inline void LexerServer::giveBack(std::unique_ptr<Connection> c)
+{
+    {
+        std::lock_guard<std::mutex> lock(returnedMutex);
+        if (closing) return;
+        returned.push_back(std::move(c));
+    }
+    char byte = 0;
+    (void)!::write(wakeWrite, &byte, 1);
+}
+
+inline void LexerServer::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(returnedMutex);
+        closing = true;
+    }
+    // Finishes the requests under way, whose handlers may still use the pool
+    if (pool) pool->finish();
+    pool.reset();
+    returned.clear();
+    idle.clear();
+    if (listenFd >= 0) ::close(listenFd);
+    if (bound) ::unlink(path.c_str());
+    if (wakeRead >= 0) ::close(wakeRead);
+    if (wakeWrite >= 0) ::close(wakeWrite);
+    listenFd = wakeRead = wakeWrite = -1;
+    bound = false;
+}
+
+inline bool LexerClient::connect(const std::string& socketPath)
+{
+    using namespace lexer_server_detail;
+    sockaddr_un address;
+    if (!setAddress(socketPath, address, errorText)) return false;
+    if (fd >= 0) ::close(fd);
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return fail(std::strerror(errno));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0) {
+        std::string why = std::strerror(errno);
+        ::close(fd);
+        fd = -1;
+        return fail(why);
+    }
+    return true;
+}
+
+inline bool LexerClient::lex(const LexRequest& request, LexReply& reply)
+{
+    using namespace lexer_server_detail;
+    if (fd < 0) return fail("not connected");
+    RequestHeader header;
+    header.format = request.binary ? BinaryFormat : (uint32_t)request.format;
+    header.length = request.source.size();
+    iovec iov[2] = {{&header, sizeof header}, {const_cast<char*>(request.source.data()), request.source.size()}};
+    if (!sendAll(fd, iov, 2)) return fail(std::strerror(errno));
+
+    ReplyHeader answer;
+    if (!readFully(fd, &answer, sizeof answer) ||
+        std::memcmp(answer.magic, ReplyHeader().magic, sizeof answer.magic) != 0) {
+        return fail("the server closed the connection");
+    }
+    reply.status = (int)answer.status;
+    reply.output.resize(answer.outputLength);
+    reply.diagnostics.resize(answer.diagnosticsLength);
+    if (!readFully(fd, &reply.output[0], reply.output.size()) ||
+        !readFully(fd, &reply.diagnostics[0], reply.diagnostics.size())) {
+        return fail("the server closed the connection");
+    }
+    return true;
+}
+
+#endif
+
+// --connect: sends the file at path ("-" for stdin) to the server at
+// socketPath and prints the reply as the lexer itself would have: the tokens
+// in format on stdout, or as a binary stream to binaryPath if that is set,
+// and the diagnostics on stderr. Returns the server's status.
+inline int runLexClient(const std::string& socketPath, const std::string& path, TokenFormat format,
+                        const std::string& binaryPath)
+{
+    SourceFile source;
+    if (!source.open(path)) {
+        std::cerr << "Error: Could not open file '" << path << "' (" << source.error() << ")" << std::endl;
+        return 1;
+    }
+    LexRequest request;
+    request.format = format;
+    request.binary = !binaryPath.empty();
+    request.source = source.view();
+    LexerClient client;
+    LexReply reply;
+    if (!client.connect(socketPath) || !client.lex(request, reply)) {
+        std::cerr << "Error: No reply from '" << socketPath << "' (" << client.error() << ")" << std::endl;
+        return 1;
+    }
+    std::cerr << reply.diagnostics;
+    if (request.binary && binaryPath != "-") {
+        std::ofstream file(binaryPath, std::ios::binary | std::ios::trunc);
+        if (!file.write(reply.output.data(), (std::streamsize)reply.output.size())) {
+            std::cerr << "Error: Could not write '" << binaryPath << "'" << std::endl;
+            return 1;
+        }
+    }
+    else {
+        std::cout.write(reply.output.data(), (std::streamsize)reply.output.size());
+    }
+    return reply.status;
+}
+
+#endif
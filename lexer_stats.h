@@ -0,0 +1,126 @@
+#ifndef LEXER_STATS_H
+#define LEXER_STATS_H
+
+// Optional instrumentation for the lexers' hot paths. Everything here, and
+// every LEXER_STATS_ONLY(...) in the lexers, compiles away unless the build
+// defines LEXER_STATS (g++ -DLEXER_STATS ...).
+
+#ifdef LEXER_STATS
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "alloc_counter.h"
+
+#define LEXER_STATS_ONLY(...) __VA_ARGS__
+
+struct LexerStats
+{
+    // Where the input bytes went. Bytes the lexer skips or drops on an error
+    // are not counted.
+    enum ByteClass { Whitespace, Comment, String, Identifier, Number, Operator, Other, ByteClasses };
+    enum Phase { Read, Lex, Emit, Phases };
+
+    std::vector<uint64_t> tokens; // Indexed by the lexer's TokenType
+    uint64_t bytes[ByteClasses] = {};
+    uint64_t errors = 0;
+    // Identifier interning (lexer_noregex): distinct identifiers, the bytes
+    // of their names, and the bytes the symbol table allocated to hold them.
+    // Summed over the files of a --batch run.
+    uint64_t symbols = 0, symbolNameBytes = 0, symbolTableBytes = 0;
+    double seconds[Phases] = {};
+    uint64_t allocations[Phases] = {};
+
+    explicit LexerStats(size_t tokenTypes) : tokens(tokenTypes) {}
+
+    // Adds the counters of other. Phase times add up across threads, so in a
+    // parallel run they measure work rather than wall-clock time.
+    void merge(const LexerStats& other)
+    {
+        for (size_t i = 0; i < tokens.size(); i++) tokens[i] += other.tokens[i];
+        for (int c = 0; c < ByteClasses; c++) bytes[c] += other.bytes[c];
+        errors += other.errors;
+        symbols += other.symbols;
+        symbolNameBytes += other.symbolNameBytes;
+        symbolTableBytes += other.symbolTableBytes;
+        for (int p = 0; p < Phases; p++) {
+            seconds[p] += other.seconds[p];
+            allocations[p] += other.allocations[p];
+        }
+    }
+
+    // Writes writeJson() to path, or to stderr for "-". False if the file
+    // cannot be written.
+    bool save(const std::string& path, const char* lexer, const char* const typeNames[]) const
+    {
+        if (path == "-") {
+            writeJson(std::cerr, lexer, typeNames);
+            return true;
+        }
+        std::ofstream out(path);
+        writeJson(out, lexer, typeNames);
+        return bool(out);
+    }
+
+    void writeJson(std::ostream& out, const char* lexer, const char* const typeNames[]) const
+    {
+        static const char* const classNames[] = {"whitespace", "comment", "string", "identifier", "number", "operator", "other"};
+        static const char* const phaseNames[] = {"read", "lex", "emit"};
+        uint64_t total = 0;
+        for (uint64_t n : tokens) total += n;
+
+        out << "{\n  \"lexer\": \"" << lexer << "\",\n  \"tokens\": " << total << ",\n  \"tokens_by_type\": {";
+        for (size_t i = 0; i < tokens.size(); i++) {
+            out << (i ? ", " : "") << "\"" << typeNames[i] << "\": " << tokens[i];
+        }
+        out << "},\n  \"bytes_by_class\": {";
+        for (int c = 0; c < ByteClasses; c++) {
+            out << (c ? ", " : "") << "\"" << classNames[c] << "\": " << bytes[c];
+        }
+        out << "},\n  \"errors\": " << errors << ",\n  \"symbols\": {\"unique\": " << symbols
+            << ", \"name_bytes\": " << symbolNameBytes << ", \"allocated_bytes\": " << symbolTableBytes
+            << "},\n  \"phases\": {";
+        for (int p = 0; p < Phases; p++) {
+            out << (p ? ", " : "") << "\"" << phaseNames[p] << "\": {\"seconds\": " << seconds[p]
+                << ", \"allocations\": " << allocations[p] << "}";
+        }
+        out << "}\n}\n";
+    }
+};
+
+// Adds the time and allocations from construction to stop() to one phase.
+// Does nothing without a LexerStats to report to.
+class PhaseTimer
+{
+public:
+    PhaseTimer(LexerStats* stats, LexerStats::Phase phase)
+        : stats(stats), phase(phase), start(std::chrono::steady_clock::now()),
+          allocationsBefore(allocation_count.load(std::memory_order_relaxed)) {}
+
+    void stop()
+    {
+        if (!stats) return;
+        stats->seconds[phase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stats->allocations[phase] += allocation_count.load(std::memory_order_relaxed) - allocationsBefore;
+        stats = nullptr;
+    }
+
+    ~PhaseTimer() { stop(); }
+
+private:
+    LexerStats* stats;
+    LexerStats::Phase phase;
+    std::chrono::steady_clock::time_point start;
+    size_t allocationsBefore;
+};
+
+#else
+
+#define LEXER_STATS_ONLY(...)
+
+#endif
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef REGEX_DFA_H
+#define REGEX_DFA_H
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A prioritized set of patterns compiled into one minimized, table-driven DFA
+// over bytes. longestMatch() returns the longest prefix any pattern matches;
+// ties go to the pattern listed first, which reproduces std::regex's
+// first-alternative choice for token tables whose alternatives only overlap
+// as prefixes of each other (keywords vs identifiers, "<=" vs "<", ...).
+//
+// Supported syntax: literals, '.', [...] and [^...] with ranges, the escapes
+// \d \D \s \S \w \W \n \r \t and escaped punctuation, (...) and (?:...)
+// groups, '|', and the greedy quantifiers '*', '+' and '?'. '.' excludes
+// '\n' and '\r' as in ECMAScript. A leading \b is expressed with
+// DfaPattern::wordBoundaryBefore instead, since the DFA has no lookbehind.
+struct DfaPattern
+{
+    std::string regex;
+    bool wordBoundaryBefore = false;
+};
+
+class Dfa
+{
+public:
+    struct Match
+    {
+        size_t length;
+        int pattern; // Index into the pattern list, or -1 if nothing matched
+    };
+
+    explicit Dfa(const std::vector<DfaPattern>& patterns)
+    {
+        Nfa nfa;
+        std::vector<int> starts;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            Parser parser{patterns[i].regex, 0, nfa};
+            Frag f = parser.parse();
+            int acc = nfa.add();
+            nfa.states[acc].accept = (int)i;
+            nfa.patch(f, acc);
+            starts.push_back(f.start);
+        }
+        buildByteClasses(nfa);
+        determinize(nfa, starts, patterns);
+        minimize();
+    }
+
+    // Runs the DFA from s. afterWordChar disables patterns that need a word
+    // boundary before them (the previous byte was [A-Za-z0-9_]).
+    Match longestMatch(const char* s, size_t n, bool afterWordChar) const
+    {
+        Match best = {0, -1};
+        int32_t st = start[afterWordChar ? 1 : 0];
+        if (st == dead) return best;
+        for (size_t i = 0; i < n; ) {
+            st = next[(size_t)st * classCount + byteClass[(unsigned char)s[i++]]];
+            if (st == dead) break;
+            if (accept[st] >= 0) best = {i, accept[st]};
+        }
+        return best;
+    }
+
+    size_t stateCount() const { return accept.size(); }
+
+private:
+    typedef std::bitset<256> ByteSet;
+
+    // ---- Thompson NFA ----
+
+    struct NState
+    {
+        ByteSet bytes;  // Consumes one of these bytes and moves to out
+        int out = -1;
+        int eps[2] = {-1, -1};
+        int accept = -1;
+    };
+
+    // A dangling edge: field 0 is NState::out, 1 and 2 are eps[0] and eps[1].
+    struct Hole
+    {
+        int state;
+        int field;
+    };
+
+    struct Frag
+    {
+        int start;
+        std::vector<Hole> holes;
+    };
+
+    struct Nfa
+    {
+        std::vector<NState> states;
+
+        int add()
+        {
+            states.push_back(NState());
+            return (int)states.size() - 1;
+        }
+
+        void patch(const Frag& f, int target)
+        {
+            for (const Hole& h : f.holes) {
+                NState& s = states[h.state];
+                (h.field == 0 ? s.out : s.eps[h.field - 1]) = target;
+            }
+        }
+
+        Frag byteSet(const ByteSet& set)
+        {
+            int s = add();
+            states[s].bytes = set;
+            return {s, {{s, 0}}};
+        }
+
+        Frag epsilon()
+        {
+            int s = add();
+            return {s, {{s, 1}}};
+        }
+    };
+
+    static bool isWordByte(unsigned char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static ByteSet classEscape(char e)
+    {
+        ByteSet set;
+        switch (e) {
+            case 'd': case 'D':
+                for (int c = '0'; c <= '9'; c++) set.set(c);
+                break;
+            case 's': case 'S':
+                for (int c : {' ', '\t', '\n', '\v', '\f', '\r'}) set.set(c);
+                break;
+            case 'w': case 'W':
+                for (int c = 0; c < 256; c++) if (isWordByte((unsigned char)c)) set.set(c);
+                break;
+            case 'n': set.set('\n'); return set;
+            case 'r': set.set('\r'); return set;
+            case 't': set.set('\t'); return set;
+            default: set.set((unsigned char)e); return set;
+        }
+        if (e == 'D' || e == 'S' || e == 'W') set.flip();
+        return set;
+    }
+
+    struct Parser
+    {
+        const std::string& re;
+        size_t i;
+        Nfa& nfa;
+
+        Frag parse()
+        {
+            Frag f = alternation();
+            if (i != re.size()) fail("unexpected ')'");
+            return f;
+        }
+
+        [[noreturn]] void fail(const char* what) const
+        {
+            throw std::invalid_argument("Dfa: " + std::string(what) + " in pattern " + re);
+        }
+
+        bool more() const { return i < re.size(); }
+
+        Frag alternation()
+        {
+            Frag left = concatenation();
+            while (more() && re[i] == '|') {
+                i++;
+                Frag right = concatenation();
+                int s = nfa.add();
+                nfa.states[s].eps[0] = left.start;
+                nfa.states[s].eps[1] = right.start;
+                left.start = s;
+                left.holes.insert(left.holes.end(), right.holes.begin(), right.holes.end());
+            }
+            return left;
+        }
+
+        Frag concatenation()
+        {
+            Frag f = nfa.epsilon();
+            while (more() && re[i] != '|' && re[i] != ')') {
+                Frag g = repetition();
+                nfa.patch(f, g.start);
+                f.holes = g.holes;
+            }
+            return f;
+        }
+
+        Frag repetition()
+        {
+            Frag f = atom();
+            while (more() && (re[i] == '*' || re[i] == '+' || re[i] == '?')) {
+                char q = re[i++];
+                if (more() && re[i] == '?') fail("lazy quantifiers are not supported");
+                int s = nfa.add();
+                nfa.states[s].eps[0] = f.start;
+                if (q == '?') {
+                    f.start = s;
+                    f.holes.push_back({s, 2});
+                } else {
+                    nfa.patch(f, s);
+                    f.start = q == '*' ? s : f.start;
+                    f.holes.assign(1, {s, 2});
+                }
+            }
+            return f;
+        }
+
+        Frag atom()
+        {
+            char c = re[i++];
+            if (c == '(') {
+                if (re.compare(i, 2, "?:") == 0) i += 2;
+                Frag f = alternation();
+                if (!more() || re[i] != ')') fail("missing ')'");
+                i++;
+                return f;
+            }
+            if (c == '[') return nfa.byteSet(bracket());
+            if (c == '.') {
+                ByteSet set;
+                set.set();
+                set.reset('\n');
+                set.reset('\r');
+                return nfa.byteSet(set);
+            }
+            if (c == '\\') {
+                if (!more()) fail("trailing backslash");
+                char e = re[i++];
+                if (e == 'b') fail("\\b is only supported as DfaPattern::wordBoundaryBefore");
+                return nfa.byteSet(classEscape(e));
+            }
+            if (c == '*' || c == '+' || c == '?' || c == ')') fail("misplaced operator");
+            ByteSet set;
+            set.set((unsigned char)c);
+            return nfa.byteSet(set);
+        }
+
+        ByteSet bracket()
+        {
+            ByteSet set;
+            bool negate = more() && re[i] == '^';
+            if (negate) i++;
+            bool first = true;
+            while (more() && (re[i] != ']' || first)) {
+                first = false;
+                if (re[i] == '\\' && i + 1 < re.size()) {
+                    set |= classEscape(re[i + 1]);
+                    i += 2;
+                    continue;
+                }
+                unsigned char lo = (unsigned char)re[i++];
+                if (i + 1 < re.size() && re[i] == '-' && re[i + 1] != ']') {
+                    unsigned char hi = (unsigned char)re[i + 1];
+                    i += 2;
+                    for (int b = lo; b <= hi; b++) set.set(b);
+                } else {
+                    set.set(lo);
+                }
+            }
+            if (!more()) fail("missing ']'");
+            i++;
+            if (negate) set.flip();
+            return set;
+        }
+    };
+
+    // ---- DFA ----
+
+    static constexpr int32_t dead = -1;
+    uint8_t byteClass[256];
+    size_t classCount = 0;
+    std::vector<int32_t> next;   // stateCount * classCount, dead when no move
+    std::vector<int32_t> accept; // Pattern index per state, or -1
+    int32_t start[2] = {0, 0};
+
+    // Bytes no pattern can tell apart share one column of the table.
+    void buildByteClasses(const Nfa& nfa)
+    {
+        std::vector<std::vector<bool>> signature(256);
+        for (const NState& s : nfa.states) {
+            if (s.out < 0 && s.bytes.none()) continue;
+            for (int b = 0; b < 256; b++) signature[b].push_back(s.bytes[b]);
+        }
+        std::map<std::vector<bool>, uint8_t> ids;
+        for (int b = 0; b < 256; b++) {
+            auto it = ids.emplace(signature[b], (uint8_t)ids.size()).first;
+            byteClass[b] = it->second;
+        }
+        classCount = ids.size();
+    }
+
+    static void closure(const Nfa& nfa, std::vector<int>& set)
+    {
+        std::vector<bool> seen(nfa.states.size());
+        std::vector<int> stack(set);
+        set.clear();
+        while (!stack.empty()) {
+            int s = stack.back();
+            stack.pop_back();
+            if (s < 0 || seen[s]) continue;
+            seen[s] = true;
+            set.push_back(s);
+            stack.push_back(nfa.states[s].eps[0]);
+            stack.push_back(nfa.states[s].eps[1]);
+        }
+        std::sort(set.begin(), set.end());
+    }
+
+    void determinize(const Nfa& nfa, const std::vector<int>& starts, const std::vector<DfaPattern>& patterns)
+    {
+        std::vector<unsigned char> representative(classCount);
+        for (int b = 255; b >= 0; b--) representative[byteClass[b]] = (unsigned char)b;
+
+        std::map<std::vector<int>, int32_t> ids;
+        std::vector<std::vector<int>> pending;
+        auto intern = [&](std::vector<int>& set) -> int32_t {
+            closure(nfa, set);
+            if (set.empty()) return dead;
+            auto found = ids.find(set);
+            if (found != ids.end()) return found->second;
+            int32_t id = (int32_t)accept.size();
+            int best = -1;
+            for (int s : set) {
+                int a = nfa.states[s].accept;
+                if (a >= 0 && (best < 0 || a < best)) best = a;
+            }
+            accept.push_back(best);
+            next.resize(next.size() + classCount, dead);
+            ids.emplace(set, id);
+            pending.push_back(set);
+            return id;
+        };
+
+        std::vector<int> all(starts), noBoundary;
+        for (size_t i = 0; i < starts.size(); i++) {
+            if (!patterns[i].wordBoundaryBefore) noBoundary.push_back(starts[i]);
+        }
+        start[0] = intern(all);
+        start[1] = intern(noBoundary);
+
+        for (size_t done = 0; done < pending.size(); done++) {
+            std::vector<int> from = pending[done];
+            for (size_t k = 0; k < classCount; k++) {
+                std::vector<int> to;
+                for (int s : from) {
+                    if (nfa.states[s].bytes[representative[k]]) to.push_back(nfa.states[s].out);
+                }
+                next[done * classCount + k] = intern(to);
+            }
+        }
+    }
+
+    // Moore-style partition refinement: start from "which pattern accepts"
+    // and split blocks until every state in a block moves alike.
+    void minimize()
+    {
+        size_t n = accept.size();
+        std::vector<int32_t> block(n);
+        {
+            std::map<int32_t, int32_t> byAccept;
+            for (size_t s = 0; s < n; s++) {
+                block[s] = byAccept.emplace(accept[s], (int32_t)byAccept.size()).first->second;
+            }
+        }
+        size_t blocks = 0;
+        while (true) {
+            std::map<std::vector<int32_t>, int32_t> signatures;
+            std::vector<int32_t> refined(n);
+            for (size_t s = 0; s < n; s++) {
+                std::vector<int32_t> sig = {block[s]};
+                for (size_t k = 0; k < classCount; k++) {
+                    int32_t t = next[s * classCount + k];
+                    sig.push_back(t == dead ? dead : block[t]);
+                }
+                refined[s] = signatures.emplace(sig, (int32_t)signatures.size()).first->second;
+            }
+            block.swap(refined);
+            if (signatures.size() == blocks) break;
+            blocks = signatures.size();
+        }
+
+        std::vector<int32_t> newNext(blocks * classCount, dead), newAccept(blocks, -1);
+        for (size_t s = 0; s < n; s++) {
+            int32_t b = block[s];
+            newAccept[b] = accept[s];
+            for (size_t k = 0; k < classCount; k++) {
+                int32_t t = next[s * classCount + k];
+                newNext[(size_t)b * classCount + k] = t == dead ? dead : block[t];
+            }
+        }
+        next.swap(newNext);
+        accept.swap(newAccept);
+        for (int32_t& s : start) {
+            if (s != dead) s = block[s];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef SCAN_KERNELS_H
+#define SCAN_KERNELS_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// Byte-class scanners used by the hand-written lexer's inner loops. Every
+// kernel looks at s[pos, end) and returns the first position that stops the
+// scan, or end. The classes match the "C" locale isspace/isalnum the scalar
+// lexer used: whitespace is ' ' and '\t'..'\r', identifier bytes are
+// [A-Za-z0-9_] plus any byte >= 0x80.
+struct ScanKernels
+{
+    const char* name;
+    size_t (*spaceEnd)(const char* s, size_t pos, size_t end);
+    size_t (*identEnd)(const char* s, size_t pos, size_t end);
+    // First '"', '\\' or '\n'
+    size_t (*stringStop)(const char* s, size_t pos, size_t end);
+    // Start of the first "*/" that lies wholly inside [pos, end)
+    size_t (*commentClose)(const char* s, size_t pos, size_t end);
+    // First '\n' or byte >= 0x80, for the UTF-8 check
+    size_t (*utf8Stop)(const char* s, size_t pos, size_t end);
+};
+
+namespace scan_detail {
+
+inline bool isSpaceByte(unsigned char c) { return c == ' ' || (unsigned char)(c - '\t') <= 4; }
+
+inline bool isIdentByte(unsigned char c)
+{
+    return (unsigned char)(c - '0') <= 9 || (unsigned char)((c | 0x20) - 'a') <= 25 || c == '_' || c >= 0x80;
+}
+
+inline size_t spaceEndScalar(const char* s, size_t pos, size_t end)
+{
+    while (pos < end && isSpaceByte((unsigned char)s[pos])) pos++;
+    return pos;
+}
+
+inline size_t identEndScalar(const char* s, size_t pos, size_t end)
+{
+    while (pos < end && isIdentByte((unsigned char)s[pos])) pos++;
+    return pos;
+}
+
+inline size_t stringStopScalar(const char* s, size_t pos, size_t end)
+{
+    while (pos < end && s[pos] != '"' && s[pos] != '\\' && s[pos] != '\n') pos++;
+    return pos;
+}
+
+inline size_t commentCloseScalar(const char* s, size_t pos, size_t end)
+{
+    for (size_t i = pos; i + 1 < end; i++) {
+        if (s[i] == '*' && s[i + 1] == '/') return i;
+    }
+    return end;
+}
+
+inline size_t utf8StopScalar(const char* s, size_t pos, size_t end)
+{
+    while (pos < end && s[pos] != '\n' && (unsigned char)s[pos] < 0x80) pos++;
+    return pos;
+}
+
+#ifdef SCAN_KERNELS_X86
+
+// The SSE2 and AVX2 kernels share one shape: classify a whole block into a
+// bitmask, stop at its first set bit, and hand the tail to the scalar loop.
+
+__attribute__((target("sse2"))) inline unsigned spaceMask16(__m128i v)
+{
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+    __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(ctl, sp));
+}
+
+__attribute__((target("sse2"))) inline unsigned identMask16(__m128i v)
+{
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i alpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(25)), a);
+    __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha), _mm_or_si128(under, v)));
+}
+
+__attribute__((target("sse2"))) inline size_t spaceEndSSE2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 16 <= end; pos += 16) {
+        unsigned stop = ~spaceMask16(_mm_loadu_si128((const __m128i*)(s + pos))) & 0xFFFF;
+        if (stop) return pos + __builtin_ctz(stop);
+    }
+    return spaceEndScalar(s, pos, end);
+}
+
+__attribute__((target("sse2"))) inline size_t identEndSSE2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 16 <= end; pos += 16) {
+        unsigned stop = ~identMask16(_mm_loadu_si128((const __m128i*)(s + pos))) & 0xFFFF;
+        if (stop) return pos + __builtin_ctz(stop);
+    }
+    return identEndScalar(s, pos, end);
+}
+
+__attribute__((target("sse2"))) inline size_t stringStopSSE2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + pos));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+        unsigned m = (unsigned)_mm_movemask_epi8(hit);
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return stringStopScalar(s, pos, end);
+}
+
+__attribute__((target("sse2"))) inline size_t commentCloseSSE2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 17 <= end; pos += 16) {
+        __m128i star = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + pos)), _mm_set1_epi8('*'));
+        __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + pos + 1)), _mm_set1_epi8('/'));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(star, slash));
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return commentCloseScalar(s, pos, end);
+}
+
+__attribute__((target("sse2"))) inline size_t utf8StopSSE2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + pos));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return utf8StopScalar(s, pos, end);
+}
+
+__attribute__((target("avx2"))) inline unsigned spaceMask32(__m256i v)
+{
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+    __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(ctl, sp));
+}
+
+__attribute__((target("avx2"))) inline unsigned identMask32(__m256i v)
+{
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i a = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(25)), a);
+    __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_or_si256(under, v)));
+}
+
+// Identifiers and whitespace runs are usually short, so the AVX2 versions
+// try one 16-byte block before switching to 32-byte strides.
+__attribute__((target("avx2"))) inline size_t spaceEndAVX2(const char* s, size_t pos, size_t end)
+{
+    if (pos + 16 <= end) {
+        unsigned stop = ~spaceMask16(_mm_loadu_si128((const __m128i*)(s + pos))) & 0xFFFF;
+        if (stop) return pos + __builtin_ctz(stop);
+        pos += 16;
+    }
+    for (; pos + 32 <= end; pos += 32) {
+        unsigned stop = ~spaceMask32(_mm256_loadu_si256((const __m256i*)(s + pos)));
+        if (stop) return pos + __builtin_ctz(stop);
+    }
+    return spaceEndSSE2(s, pos, end);
+}
+
+__attribute__((target("avx2"))) inline size_t identEndAVX2(const char* s, size_t pos, size_t end)
+{
+    if (pos + 16 <= end) {
+        unsigned stop = ~identMask16(_mm_loadu_si128((const __m128i*)(s + pos))) & 0xFFFF;
+        if (stop) return pos + __builtin_ctz(stop);
+        pos += 16;
+    }
+    for (; pos + 32 <= end; pos += 32) {
+        unsigned stop = ~identMask32(_mm256_loadu_si256((const __m256i*)(s + pos)));
+        if (stop) return pos + __builtin_ctz(stop);
+    }
+    return identEndSSE2(s, pos, end);
+}
+
+__attribute__((target("avx2"))) inline size_t stringStopAVX2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 32 <= end; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + pos));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+        unsigned m = (unsigned)_mm256_movemask_epi8(hit);
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return stringStopSSE2(s, pos, end);
+}
+
+__attribute__((target("avx2"))) inline size_t commentCloseAVX2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 33 <= end; pos += 32) {
+        __m256i star = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + pos)), _mm256_set1_epi8('*'));
+        __m256i slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + pos + 1)), _mm256_set1_epi8('/'));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(star, slash));
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return commentCloseSSE2(s, pos, end);
+}
+
+__attribute__((target("avx2"))) inline size_t utf8StopAVX2(const char* s, size_t pos, size_t end)
+{
+    for (; pos + 32 <= end; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + pos));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+        if (m) return pos + __builtin_ctz(m);
+    }
+    return utf8StopSSE2(s, pos, end);
+}
+
+#endif
+
+inline const ScanKernels& pickScanKernels()
+{
+    static const ScanKernels scalar = {
+        "scalar", spaceEndScalar, identEndScalar, stringStopScalar, commentCloseScalar, utf8StopScalar
+    };
+#ifdef SCAN_KERNELS_X86
+    static const ScanKernels sse2 = {
+        "sse2", spaceEndSSE2, identEndSSE2, stringStopSSE2, commentCloseSSE2, utf8StopSSE2
+    };
+    static const ScanKernels avx2 = {
+        "avx2", spaceEndAVX2, identEndAVX2, stringStopAVX2, commentCloseAVX2, utf8StopAVX2
+    };
+    // LEXER_SIMD=scalar|sse2 caps the choice, for benchmarking and testing.
+    const char* cap = std::getenv("LEXER_SIMD");
+    if (cap && std::strcmp(cap, "scalar") == 0) return scalar;
+    __builtin_cpu_init();
+    bool capSSE2 = cap && std::strcmp(cap, "sse2") == 0;
+    if (!capSSE2 && __builtin_cpu_supports("avx2")) return avx2;
+    if (__builtin_cpu_supports("sse2")) return sse2;
+#endif
+    return scalar;
+}
+
+} // namespace scan_detail
+
+// The best kernels this CPU supports, chosen once.
+inline const ScanKernels& scanKernels()
+{
+    static const ScanKernels& chosen = scan_detail::pickScanKernels();
+    return chosen;
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef SOURCE_FILE_H
+#define SOURCE_FILE_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only input buffer for the lexers. Regular files are memory-mapped so
+// tokenize() runs straight over the page cache with no intermediate copy;
+// pipes, ttys and stdin ("-") are read() into an owned buffer instead. On
+// Windows the file is read through an ifstream as before.
+class SourceFile
+{
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    SourceFile(SourceFile&& other) noexcept { *this = std::move(other); }
+
+    SourceFile& operator=(SourceFile&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            mapped = other.mapped;
+            buffer = std::move(other.buffer);
+            data = mapped ? other.data : buffer.data();
+            length = other.length;
+            other.mapped = false;
+            other.data = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    ~SourceFile() { release(); }
+
+    // Returns false if the file cannot be opened or read; error() then says why.
+    bool open(const std::string& path)
+    {
+        release();
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return fail("cannot open");
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+#else
+        int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return fail(std::strerror(errno));
+
+        struct stat st;
+        bool ok = true;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+                mapped = true;
+                data = static_cast<const char*>(p);
+                length = (size_t)st.st_size;
+            } else {
+                ok = readAll(fd);
+            }
+        } else {
+            ok = readAll(fd);
+        }
+
+        if (fd != STDIN_FILENO) ::close(fd);
+        return ok;
+#endif
+    }
+
+    std::string_view view() const { return std::string_view(data ? data : "", length); }
+    bool isMapped() const { return mapped; }
+    const std::string& error() const { return errorText; }
+
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer;
+    std::string errorText;
+
+    bool fail(const char* why)
+    {
+        errorText = why;
+        return false;
+    }
+
+#ifndef _WIN32
+    bool readAll(int fd)
+    {
+        const size_t chunk = 1 << 16;
+        size_t used = 0;
+        for (;;) {
+            buffer.resize(used + chunk);
+            ssize_t n = ::read(fd, &buffer[used], chunk);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                buffer.clear();
+                return fail(std::strerror(errno));
+            }
+            if (n == 0) break;
+            used += (size_t)n;
+        }
+        buffer.resize(used);
+        data = buffer.data();
+        length = used;
+        return true;
+    }
+#endif
+
+    void release()
+    {
+#ifndef _WIN32
+        if (mapped) munmap(const_cast<char*>(data), length);
+#endif
+        mapped = false;
+        data = nullptr;
+        length = 0;
+        buffer.clear();
+        errorText.clear();
+    }
+};
+
+// Input read as it arrives, for the streaming lexer. Each read() returns what
+// a single read(2) gives, so bytes written to a pipe or tty are handed on as
+// soon as they come instead of once a whole buffer has filled. On Windows it
+// reads through an ifstream, or cin for "-", and fills the buffer as before.
+class SourceStream
+{
+public:
+    SourceStream() = default;
+    SourceStream(const SourceStream&) = delete;
+    SourceStream& operator=(const SourceStream&) = delete;
+
+    ~SourceStream()
+    {
+#ifndef _WIN32
+        if (fd > STDIN_FILENO) ::close(fd);
+#endif
+    }
+
+    // "-" is stdin. Returns false if the file cannot be opened; error() then
+    // says why.
+    bool open(const std::string& path)
+    {
+#ifdef _WIN32
+        if (path == "-") return true;
+        file.open(path, std::ios::binary);
+        if (!file) return fail("cannot open");
+        in = &file;
+        return true;
+#else
+        fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+        return fd >= 0 || fail(std::strerror(errno));
+#endif
+    }
+
+    // Called before a read that will have to wait for input, so a caller can
+    // pass on what it has made of the input so far. On Windows, before every
+    // read.
+    void onWait(std::function<void()> callback) { waiting = std::move(callback); }
+
+    // Reads up to n bytes to `to`, waiting only while none are available.
+    // Returns 0 at end of input, or on an error, which error() then names.
+    size_t read(char* to, size_t n)
+    {
+#ifdef _WIN32
+        if (waiting) waiting();
+        in->read(to, (std::streamsize)n);
+        if (in->bad()) fail("read error");
+        return (size_t)in->gcount();
+#else
+        pollfd input = {fd, POLLIN, 0};
+        if (waiting && ::poll(&input, 1, 0) == 0) waiting();
+        while (true) {
+            ssize_t got = ::read(fd, to, n);
+            if (got >= 0) return (size_t)got;
+            if (errno != EINTR) {
+                fail(std::strerror(errno));
+                return 0;
+            }
+        }
+#endif
+    }
+
+    const std::string& error() const { return errorText; }
+
+private:
+#ifdef _WIN32
+    std::ifstream file;
+    std::istream* in = &std::cin;
+#else
+    int fd = -1;
+#endif
+    std::function<void()> waiting;
+    std::string errorText;
+
+    bool fail(const char* why)
+    {
+        errorText = why;
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Fixed ring of reusable slots passed from one producer thread to one
+// consumer thread. The producer fills the slot startWrite() hands it and
+// publishes it with finishWrite(); the consumer takes slots in the same order
+// with startRead() and gives them back with finishRead(). Slots are never
+// freed or reallocated, so a slot that owns buffers (a batch of tokens and
+// their text) keeps its capacity from one round to the next.
+//
+// The two sides share nothing but two counters, each written by one side
+// only, so no locks are taken. A side that finds the ring full (the consumer
+// is behind) or empty (the producer is behind) spins briefly, then yields,
+// then sleeps in short naps: the full ring is the backpressure that keeps
+// memory bounded, and a side blocked for long, say on a slow input, does not
+// burn a core.
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity) : slots(capacity ? capacity : 1) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer: the next slot to fill, once the consumer has released it.
+    T& startWrite()
+    {
+        for (unsigned spins = 0; written - read.load(std::memory_order_acquire) == slots.size(); spins++) pause(spins);
+        return slots[written % slots.size()];
+    }
+
+    void finishWrite() { published.store(++written, std::memory_order_release); }
+
+    // Producer: no more slots will be written.
+    void close() { closed.store(true, std::memory_order_release); }
+
+    // Consumer: the next published slot, or nullptr once the producer has
+    // closed the ring and every slot has been read.
+    T* startRead()
+    {
+        for (unsigned spins = 0; taken == published.load(std::memory_order_acquire); spins++) {
+            if (closed.load(std::memory_order_acquire) && taken == published.load(std::memory_order_acquire)) return nullptr;
+            pause(spins);
+        }
+        return &slots[taken % slots.size()];
+    }
+
+    void finishRead() { read.store(++taken, std::memory_order_release); }
+
+    // Consumer: whether startRead() has a slot to return at once, for a
+    // consumer with something to do before it waits.
+    bool ready() const { return taken != published.load(std::memory_order_acquire); }
+
+private:
+    std::vector<T> slots;
+    // Counts of slots published and released, each with its one writer's
+    // plain copy beside it, on separate cache lines so that the two sides
+    // do not contend for one.
+    alignas(64) std::atomic<size_t> published{0};
+    size_t written = 0;
+    alignas(64) std::atomic<size_t> read{0};
+    size_t taken = 0;
+    alignas(64) std::atomic<bool> closed{false};
+
+    static void pause(unsigned spins)
+    {
+        if (spins < 64) return;
+        if (spins < 128) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+};
+
+#endif
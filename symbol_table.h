@@ -0,0 +1,131 @@
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Interned identifier spellings. intern() gives every distinct spelling a
+// small id, dense from 0 in order of first appearance, so later stages can
+// compare identifiers by id. Spellings are copied into a bump arena of large
+// blocks, and the table maps them to ids by open addressing with linear
+// probing, keeping each slot's hash so that growing never rehashes a
+// spelling. Names stay valid, and ids stable, for the table's lifetime,
+// including across moves.
+class SymbolTable
+{
+public:
+    SymbolTable() : slots(InitialSlots) {}
+
+    SymbolTable(SymbolTable&&) = default;
+    SymbolTable& operator=(SymbolTable&&) = default;
+
+    uint32_t intern(std::string_view name)
+    {
+        uint32_t hash = hashOf(name);
+        size_t mask = slots.size() - 1;
+        for (size_t k = hash & mask;; k = (k + 1) & mask) {
+            Slot& slot = slots[k];
+            if (slot.id == Empty) {
+                slot = {hash, (uint32_t)names.size()};
+                names.push_back(store(name));
+                if (names.size() * 2 > slots.size()) grow();
+                return (uint32_t)names.size() - 1;
+            }
+            if (slot.hash == hash && names[slot.id] == name) return slot.id;
+        }
+    }
+
+    std::string_view name(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+    // Interns every name of other and returns, indexed by other's ids, the
+    // ids they have here.
+    std::vector<uint32_t> absorb(const SymbolTable& other)
+    {
+        std::vector<uint32_t> ids(other.names.size());
+        for (size_t id = 0; id < ids.size(); id++) ids[id] = intern(other.names[id]);
+        return ids;
+    }
+
+    // Capacity planning: bytes of names stored, and bytes the arena and the
+    // hash table have allocated for them.
+    size_t nameBytes() const { return stored; }
+    size_t arenaBytes() const { return reserved; }
+    size_t tableBytes() const { return slots.size() * sizeof(Slot) + names.capacity() * sizeof(std::string_view); }
+
+private:
+    struct Slot
+    {
+        uint32_t hash = 0;
+        uint32_t id = Empty;
+    };
+    static constexpr uint32_t Empty = UINT32_MAX;
+    static constexpr size_t InitialSlots = 1024;
+    static constexpr size_t BlockBytes = 64 << 10;
+
+    std::vector<Slot> slots;
+    std::vector<std::string_view> names;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* next = nullptr;
+    size_t left = 0;
+    size_t stored = 0, reserved = 0;
+
+    // Word-at-a-time multiply-xor hash; identifiers are short, so this is a
+    // few multiplies per name.
+    static uint32_t hashOf(std::string_view s)
+    {
+        const uint64_t m = 0x9e3779b97f4a7c15ull;
+        uint64_t h = s.size() * m;
+        const char* p = s.data();
+        size_t n = s.size();
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * m;
+            h ^= h >> 29;
+        }
+        if (n) {
+            uint64_t w = 0;
+            std::memcpy(&w, p, n);
+            h = (h ^ w) * m;
+        }
+        h ^= h >> 32;
+        return (uint32_t)h;
+    }
+
+    std::string_view store(std::string_view name)
+    {
+        if (name.size() > left) {
+            size_t size = std::max(BlockBytes, name.size());
+            blocks.emplace_back(new char[size]);
+            next = blocks.back().get();
+            left = size;
+            reserved += size;
+        }
+        std::memcpy(next, name.data(), name.size());
+        std::string_view kept(next, name.size());
+        next += name.size();
+        left -= name.size();
+        stored += name.size();
+        return kept;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& s : old) {
+            if (s.id == Empty) continue;
+            size_t k = s.hash & mask;
+            while (slots[k].id != Empty) k = (k + 1) & mask;
+            slots[k] = s;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+// 64-bit non-cryptographic hash of data: three independent multiply-fold
+// lanes over 48-byte blocks, in the style of wyhash. Several GB/s, so hashing
+// a file costs far less than lexing it.
+inline uint64_t contentHash(std::string_view data, uint64_t seed = 0)
+{
+    auto mix = [](uint64_t a, uint64_t b) {
+        unsigned __int128 r = (unsigned __int128)a * b;
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+    };
+    auto read64 = [](const char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    };
+    const uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull;
+    const uint64_t k2 = 0x8ebc6af09c88c6e3ull, k3 = 0x589965cc75374cc3ull;
+
+    const char* p = data.data();
+    size_t n = data.size();
+    uint64_t h = mix(seed ^ k0, k1);
+    uint64_t a = h, b = h ^ k2, c = h ^ k3;
+    for (; n >= 48; p += 48, n -= 48) {
+        a = mix(read64(p) ^ k1, read64(p + 8) ^ a);
+        b = mix(read64(p + 16) ^ k2, read64(p + 24) ^ b);
+        c = mix(read64(p + 32) ^ k3, read64(p + 40) ^ c);
+    }
+    h = a ^ b ^ c;
+    for (; n >= 16; p += 16, n -= 16) h = mix(read64(p) ^ k1, read64(p + 8) ^ h);
+    uint64_t w[2] = {0, 0};
+    std::memcpy(w, p, n);
+    h = mix(w[0] ^ k1, w[1] ^ h);
+    return mix(h ^ k0, (uint64_t)data.size() ^ k1);
+}
+
+// Appends plain values and arrays to a byte string in host byte order.
+class ByteWriter
+{
+public:
+    explicit ByteWriter(std::string& out) : out(out) {}
+
+    template <typename T>
+    void put(T value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "put() copies bytes");
+        out.append(reinterpret_cast<const char*>(&value), sizeof value);
+    }
+
+    void putString(std::string_view s)
+    {
+        put<uint64_t>(s.size());
+        out.append(s.data(), s.size());
+    }
+
+    template <typename T>
+    void putVector(const std::vector<T>& v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "putVector() copies bytes");
+        put<uint64_t>(v.size());
+        out.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    }
+
+private:
+    std::string& out;
+};
+
+// Reads back what a ByteWriter wrote. Every get fails, and keeps failing,
+// once the data runs out.
+class ByteReader
+{
+public:
+    explicit ByteReader(std::string_view in) : in(in) {}
+
+    template <typename T>
+    bool get(T& value)
+    {
+        if (!take(sizeof value)) return false;
+        std::memcpy(&value, in.data() + at - sizeof value, sizeof value);
+        return true;
+    }
+
+    bool getString(std::string& s)
+    {
+        uint64_t n;
+        if (!get(n) || !take(n)) return false;
+        s.assign(in.data() + at - n, n);
+        return true;
+    }
+
+    template <typename T>
+    bool getVector(std::vector<T>& v)
+    {
+        uint64_t n;
+        if (!get(n) || n > (in.size() - at) / sizeof(T)) return fail();
+        v.resize(n);
+        if (n) std::memcpy(v.data(), in.data() + at, n * sizeof(T));
+        at += n * sizeof(T);
+        return true;
+    }
+
+    bool atEnd() const { return ok && at == in.size(); }
+
+private:
+    std::string_view in;
+    size_t at = 0;
+    bool ok = true;
+
+    bool take(uint64_t n)
+    {
+        if (!ok || n > in.size() - at) return fail();
+        at += n;
+        return true;
+    }
+    bool fail() { return ok = false; }
+};
+
+// Parses a --cache-size argument, in MB. False if text is not a number or
+// the size does not fit in 64 bits of bytes.
+inline bool parseCacheSize(std::string_view text, uint64_t& megabytes)
+{
+    uint64_t n;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), n);
+    if (ec != std::errc() || end != text.data() + text.size() || n > UINT64_MAX >> 20) return false;
+    megabytes = n;
+    return true;
+}
+
+// Lexer output kept on disk across runs, keyed by a hash of the input
+// (--cache DIR). Each entry is one file named after its lexer and key,
+// holding a header and a payload the lexer serializes itself.
+//
+// Several processes may share a directory. An entry is written to a temporary
+// file and renamed into place, so readers only ever see whole entries, and a
+// reader keeps an entry it has opened even if another process evicts it. The
+// header repeats the input's hash and size and carries a hash of the payload,
+// so a torn or foreign file is a miss rather than wrong tokens. Keys are also
+// seeded with the lexer's name and LexerVersion, so a lexer that tokenizes
+// differently, or lays out its payload differently, starts from a cold cache
+// while a rebuild of the same sources keeps its entries.
+//
+// A hit refreshes the entry's modification time, and once the directory
+// grows past its size limit the entries with the oldest times are deleted
+// first (least recently used) until it is back under 90% of the limit.
+class TokenCache
+{
+public:
+    TokenCache(std::string dir, std::string_view lexer, uint64_t maxBytes)
+        : dir(std::move(dir)), lexer(lexer), maxBytes(maxBytes)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(this->dir, ec);
+        if (!std::filesystem::is_directory(this->dir, ec)) problem = "cannot create directory";
+        seed = contentHash(std::string(lexer) + " " + std::to_string(LexerVersion));
+        std::random_device rd;
+        writerId = ((uint64_t)rd() << 32) ^ rd();
+    }
+
+    // Empty unless the directory is unusable; the cache then always misses.
+    const std::string& error() const { return problem; }
+
+    // The payload stored for source, if there is a valid entry.
+    bool load(std::string_view source, std::string& payload)
+    {
+        if (!problem.empty()) return false;
+        uint64_t key = contentHash(source, seed);
+        std::string path = entryPath(key);
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        Header h;
+        if (!file.read(reinterpret_cast<char*>(&h), sizeof h)) return false;
+        if (std::memcmp(h.magic, Magic, sizeof h.magic) != 0 || h.version != Version || h.key != key ||
+            h.sourceSize != source.size() || h.payloadSize > maxBytes) {
+            return false;
+        }
+        payload.resize(h.payloadSize);
+        if (!file.read(&payload[0], (std::streamsize)h.payloadSize) || contentHash(payload) != h.payloadHash) return false;
+        touch(path);
+        return true;
+    }
+
+    // Stores payload as the entry for source. Failures are ignored: the
+    // cache is only an accelerator.
+    void store(std::string_view source, std::string_view payload)
+    {
+        if (!problem.empty() || sizeof(Header) + payload.size() > maxBytes) return;
+        uint64_t key = contentHash(source, seed);
+        Header h;
+        std::memcpy(h.magic, Magic, sizeof h.magic);
+        h.key = key;
+        h.sourceSize = source.size();
+        h.payloadSize = payload.size();
+        h.payloadHash = contentHash(payload);
+
+        std::string temp = dir + "/.tmp-" + std::to_string(writerId) + "-" + std::to_string(tempCounter++);
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&h), sizeof h);
+            file.write(payload.data(), (std::streamsize)payload.size());
+            if (!file.flush()) {
+                file.close();
+                std::error_code ec;
+                std::filesystem::remove(temp, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, entryPath(key), ec);
+        if (ec) {
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+        if (knownBytes(sizeof h + payload.size()) > maxBytes) evict();
+    }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version = Version;
+        uint32_t reserved = 0;
+        uint64_t key = 0;
+        uint64_t sourceSize = 0;
+        uint64_t payloadSize = 0;
+        uint64_t payloadHash = 0;
+    };
+    static constexpr char Magic[8] = {'L', 'E', 'X', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr uint32_t Version = 1; // Of the entry header
+    // Bump whenever either lexer's tokens, diagnostics or cache payload change
+    static constexpr uint32_t LexerVersion = 2;
+
+    std::string dir;
+    std::string lexer;
+    uint64_t maxBytes;
+    std::string problem;
+    uint64_t seed = 0;
+    uint64_t writerId = 0;
+    std::atomic<uint64_t> tempCounter{0};
+    std::mutex sizeMutex;
+    bool scanned = false;
+    uint64_t totalBytes = 0; // This process's estimate of the directory size
+
+    std::string entryPath(uint64_t key) const
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(16, '0');
+        for (int i = 15; i >= 0; i--, key >>= 4) hex[(size_t)i] = digits[key & 15];
+        return dir + "/" + lexer + "-" + hex + ".tok";
+    }
+
+    // Refreshes the LRU time of an entry, at most once a minute.
+    static void touch(const std::string& path)
+    {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        auto now = fs::file_time_type::clock::now();
+        auto then = fs::last_write_time(path, ec);
+        if (!ec && now - then > std::chrono::minutes(1)) fs::last_write_time(path, now, ec);
+    }
+
+    // Adds added bytes to the size estimate, measuring the directory first
+    // if this process has not yet.
+    uint64_t knownBytes(uint64_t added)
+    {
+        std::lock_guard<std::mutex> lock(sizeMutex);
+        if (!scanned) {
+            totalBytes = 0;
+            std::error_code ec;
+            for (auto& e : std::filesystem::directory_iterator(dir, ec)) {
+                if (e.path().extension() == ".tok") totalBytes += e.file_size(ec);
+            }
+            scanned = true;
+        }
+        else {
+            totalBytes += added;
+        }
+        return totalBytes;
+    }
+
+    void evict()
+    {
+        namespace fs = std::filesystem;
+        std::lock_guard<std::mutex> lock(sizeMutex);
+#ifndef _WIN32
+        // One evicting process at a time; the others just carry on
+        int fd = ::open((dir + "/.lock").c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) return;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(fd);
+            return;
+        }
+#endif
+        struct Entry
+        {
+            fs::file_time_type time;
+            uint64_t size;
+            fs::path path;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        auto now = fs::file_time_type::clock::now();
+        std::error_code ec;
+        for (auto& e : fs::directory_iterator(dir, ec)) {
+            std::error_code statError;
+            auto time = e.last_write_time(statError);
+            uint64_t size = e.file_size(statError);
+            if (statError) continue;
+            std::string name = e.path().filename().string();
+            if (name.compare(0, 5, ".tmp-") == 0) {
+                // Left by a writer that died before renaming it
+                if (now - time > std::chrono::hours(1)) fs::remove(e.path(), statError);
+                continue;
+            }
+            if (e.path().extension() != ".tok") continue;
+            entries.push_back({time, size, e.path()});
+            total += size;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+        for (const Entry& e : entries) {
+            if (total <= maxBytes / 10 * 9) break;
+            fs::remove(e.path, ec);
+            total -= e.size;
+        }
+        totalBytes = total;
+#ifndef _WIN32
+        ::close(fd); // Releases the lock
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef TOKEN_PRINTER_H
+#define TOKEN_PRINTER_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include "utf8.h"
+
+// ---- Token output (--format text|tsv|jsonl) ----
+
+enum class TokenFormat { Text, Tsv, Jsonl };
+
+// Parses a --format argument; false if name is not a format.
+inline bool parseTokenFormat(std::string_view name, TokenFormat& format)
+{
+    if (name == "text") format = TokenFormat::Text;
+    else if (name == "tsv") format = TokenFormat::Tsv;
+    else if (name == "jsonl") format = TokenFormat::Jsonl;
+    else return false;
+    return true;
+}
+
+// How write(value, escaping) spells the bytes a format cannot carry as is.
+// Text turns newline, tab and CR into \n, \t and \r, as the listings always
+// have; Tsv also doubles backslashes so every value can be decoded again;
+// Json escapes quotes, backslashes and all control characters, and writes
+// each ill-formed UTF-8 sequence (its maximal subpart, see decodeUtf8()) as
+// \ufffd, so every record is valid JSON whatever bytes the input held.
+enum class Escaping { Text, Tsv, Json };
+
+// Which bytes each Escaping rewrites, indexed [escaping][byte].
+struct EscapeTable
+{
+    bool special[3][256] = {};
+    constexpr EscapeTable()
+    {
+        for (int e = 0; e < 3; e++) special[e]['\n'] = special[e]['\t'] = special[e]['\r'] = true;
+        special[(int)Escaping::Tsv]['\\'] = true;
+        for (int c = 0; c < 0x20; c++) special[(int)Escaping::Json][c] = true;
+        special[(int)Escaping::Json]['\\'] = special[(int)Escaping::Json]['"'] = true;
+        for (int c = 0x80; c < 0x100; c++) special[(int)Escaping::Json][c] = true; // Checked as UTF-8
+    }
+};
+inline constexpr EscapeTable escape_table{};
+
+// Buffers output in one large block and hands it to the stream a block at a
+// time, so printing a token is a few memcpys instead of a chain of formatted
+// stream inserts and a flush per line. Whatever is buffered is written on
+// flush() and on destruction.
+//
+// For tsv and jsonl the printer writes whole records: one line per token,
+// either tab-separated (type, value, line[, column]) or a JSON object. A
+// file name given to the constructor leads every record, for batch output.
+class TokenPrinter
+{
+public:
+    explicit TokenPrinter(std::ostream& out, TokenFormat format = TokenFormat::Text, std::string_view file = {},
+                          size_t capacity = 1 << 20)
+        : out(out), fmt(format), buffer(new char[capacity]), capacity(capacity)
+    {
+        if (file.empty()) return;
+        // Built once; each record starts with a copy
+        if (fmt == TokenFormat::Tsv) {
+            write(file, Escaping::Tsv);
+            write('\t');
+        }
+        else if (fmt == TokenFormat::Jsonl) {
+            write("\"file\":\"");
+            write(file, Escaping::Json);
+            write("\",");
+        }
+        filePrefix.assign(buffer.get(), used);
+        used = 0;
+    }
+
+    TokenPrinter(const TokenPrinter&) = delete;
+    TokenPrinter& operator=(const TokenPrinter&) = delete;
+
+    ~TokenPrinter() { flush(); }
+
+    TokenFormat format() const { return fmt; }
+
+    void write(char c)
+    {
+        if (used == capacity) flush();
+        buffer[used++] = c;
+    }
+
+    void write(std::string_view s)
+    {
+        if (s.size() > capacity - used) {
+            flush();
+            if (s.size() >= capacity) {
+                out.write(s.data(), (std::streamsize)s.size());
+                return;
+            }
+        }
+        std::memcpy(buffer.get() + used, s.data(), s.size());
+        used += s.size();
+    }
+
+    // Two digits at a time from a table; most line and column numbers are
+    // short, so this beats general-purpose conversion.
+    void writeNumber(long long n)
+    {
+        if (capacity - used < 24) flush();
+        char* out = buffer.get() + used;
+        unsigned long long u = (unsigned long long)n;
+        if (n < 0) {
+            *out++ = '-';
+            u = 0 - u;
+        }
+        char digits[20];
+        char* p = digits + sizeof digits;
+        while (u >= 100) {
+            p -= 2;
+            std::memcpy(p, DigitPairs + u % 100 * 2, 2);
+            u /= 100;
+        }
+        if (u >= 10) {
+            p -= 2;
+            std::memcpy(p, DigitPairs + u * 2, 2);
+        }
+        else {
+            *--p = (char)('0' + u);
+        }
+        size_t length = (size_t)(digits + sizeof digits - p);
+        std::memcpy(out, p, length);
+        used = (size_t)(out + length - buffer.get());
+    }
+
+    // Writes s, escaped for the format: runs of plain bytes are copied whole.
+    void write(std::string_view s, Escaping escaping)
+    {
+        const bool* special = escape_table.special[(int)escaping];
+        const char* p = s.data();
+        const char* end = p + s.size();
+        const char* from = p;
+        for (; p != end; p++) {
+            unsigned char c = (unsigned char)*p;
+            if (!special[c]) continue;
+            if (c >= 0x80) {
+                Utf8Char ch = decodeUtf8(p, (size_t)(end - p));
+                if (ch.valid) { // Copied with the run it is in
+                    p += ch.length - 1;
+                    continue;
+                }
+                write(std::string_view(from, (size_t)(p - from)));
+                write("\\ufffd");
+                p += ch.length - 1;
+                from = p + 1;
+                continue;
+            }
+            write(std::string_view(from, (size_t)(p - from)));
+            from = p + 1;
+            switch (c) {
+            case '\n': write("\\n"); break;
+            case '\t': write("\\t"); break;
+            case '\r': write("\\r"); break;
+            case '\\': write("\\\\"); break;
+            case '"': write("\\\""); break;
+            default: {
+                static const char hex[] = "0123456789abcdef";
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                write(std::string_view(u, sizeof u));
+            }
+            }
+        }
+        write(std::string_view(from, (size_t)(end - from)));
+    }
+
+    // One tsv or jsonl record. column < 0 leaves the column out, for a lexer
+    // that tracks lines only.
+    void record(std::string_view type, std::string_view value, long long line, long long column = -1)
+    {
+        if (fmt == TokenFormat::Jsonl) {
+            write('{');
+            write(filePrefix);
+            write("\"type\":\"");
+            write(type);
+            write("\",\"value\":\"");
+            write(value, Escaping::Json);
+            write("\",\"line\":");
+            writeNumber(line);
+            if (column >= 0) {
+                write(",\"column\":");
+                writeNumber(column);
+            }
+            write("}\n");
+        }
+        else {
+            write(filePrefix);
+            write(type);
+            write('\t');
+            write(value, Escaping::Tsv);
+            write('\t');
+            writeNumber(line);
+            if (column >= 0) {
+                write('\t');
+                writeNumber(column);
+            }
+            write('\n');
+        }
+    }
+
+    void flush()
+    {
+        if (used) out.write(buffer.get(), (std::streamsize)used);
+        used = 0;
+    }
+
+private:
+    std::ostream& out;
+    TokenFormat fmt;
+    std::unique_ptr<char[]> buffer;
+    size_t capacity;
+    size_t used = 0;
+    std::string filePrefix;
+
+    static constexpr const char* DigitPairs =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef TOKEN_SPEC_H
+#define TOKEN_SPEC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// ---- The token vocabulary of both lexers ----
+//
+// Each lexer builds its TokenType enum and tokenTypeToString() from its
+// *_TOKEN_TYPES list, and its keyword and operator recognizers from the
+// shared spellings plus its own. Tokens the two languages have in common are
+// listed once; where the lexers name the same token differently, the shared
+// row carries both names (noregex first).
+
+// X(type)
+#define NOREGEX_TOKEN_TYPES(X) \
+    X(T_INT) X(T_FLOAT) X(T_STRING) X(T_BOOL) X(T_RETURN) \
+    X(T_IF) X(T_ELSE) X(T_FOR) X(T_WHILE) X(T_BREAK) X(T_CONTINUE) \
+    X(T_IDENTIFIER) X(T_INTLIT) X(T_FLOATLIT) X(T_STRINGLIT) X(T_BOOLLIT) \
+    X(T_ASSIGNOP) X(T_EQUALSOP) X(T_PLUS) X(T_MINUS) X(T_MULT) X(T_DIV) X(T_MOD) \
+    X(T_LT) X(T_GT) X(T_LTE) X(T_GTE) X(T_NEQ) X(T_AND) X(T_OR) X(T_NOT) \
+    X(T_BITAND) X(T_BITOR) X(T_BITXOR) X(T_BITNOT) X(T_LEFTSHIFT) X(T_RIGHTSHIFT) \
+    X(T_PARENL) X(T_PARENR) X(T_BRACEL) X(T_BRACER) X(T_BRACKL) X(T_BRACKR) \
+    X(T_COMMA) X(T_SEMICOLON) X(T_COLON) X(T_QUESTION) X(T_DOT) X(T_COMMENT) \
+    X(T_UNKNOWN) X(T_EOF) X(T_INVALID_IDENTIFIER) X(T_INCREMENT) X(T_PLUS_ASSIGN)
+
+#define REGEX_TOKEN_TYPES(X) \
+    X(T_FUNCTION) X(T_INT) X(T_FLOAT) X(T_STRING) X(T_BOOL) X(T_RETURN) X(T_IDENTIFIER) \
+    X(T_INTLIT) X(T_FLOATLIT) X(T_STRINGLIT) X(T_BOOLLIT) X(T_PARENL) X(T_PARENR) \
+    X(T_BRACEL) X(T_BRACER) X(T_BRACKETL) X(T_BRACKETR) X(T_COMMA) X(T_SEMICOLON) \
+    X(T_COLON) X(T_ASSIGNOP) X(T_EQUALSOP) X(T_NOTEQUALS) X(T_LESSTHAN) \
+    X(T_GREATERTHAN) X(T_LESSEQUAL) X(T_GREATEREQUAL) X(T_PLUS) X(T_MINUS) X(T_MULT) \
+    X(T_DIV) X(T_AND) X(T_OR) X(T_NOT) X(T_IF) X(T_ELSE) X(T_WHILE) X(T_FOR) \
+    X(T_COMMENT) X(T_UNKNOWN) X(T_EOF) X(T_OUTPUTOP) X(T_INPUTOP)
+
+// X(spelling, type)
+#define SHARED_KEYWORDS(X) \
+    X("int", T_INT) X("float", T_FLOAT) X("string", T_STRING) X("bool", T_BOOL) \
+    X("return", T_RETURN) X("if", T_IF) X("else", T_ELSE) X("for", T_FOR) \
+    X("while", T_WHILE) X("true", T_BOOLLIT) X("false", T_BOOLLIT)
+
+#define NOREGEX_ONLY_KEYWORDS(X) \
+    X("break", T_BREAK) X("continue", T_CONTINUE)
+
+#define REGEX_ONLY_KEYWORDS(X) \
+    X("fn", T_FUNCTION)
+
+// X(spelling, noregex type, regex type)
+#define SHARED_OPERATORS(X) \
+    X("==", T_EQUALSOP, T_EQUALSOP) X("!=", T_NEQ, T_NOTEQUALS) \
+    X("<=", T_LTE, T_LESSEQUAL) X(">=", T_GTE, T_GREATEREQUAL) \
+    X("&&", T_AND, T_AND) X("||", T_OR, T_OR) \
+    X("+", T_PLUS, T_PLUS) X("-", T_MINUS, T_MINUS) X("*", T_MULT, T_MULT) X("/", T_DIV, T_DIV) \
+    X("<", T_LT, T_LESSTHAN) X(">", T_GT, T_GREATERTHAN) X("!", T_NOT, T_NOT) \
+    X("(", T_PARENL, T_PARENL) X(")", T_PARENR, T_PARENR) \
+    X("{", T_BRACEL, T_BRACEL) X("}", T_BRACER, T_BRACER) \
+    X("[", T_BRACKL, T_BRACKETL) X("]", T_BRACKR, T_BRACKETR) \
+    X(",", T_COMMA, T_COMMA) X(";", T_SEMICOLON, T_SEMICOLON) X(":", T_COLON, T_COLON) \
+    X("=", T_ASSIGNOP, T_ASSIGNOP)
+
+// X(spelling, type)
+#define NOREGEX_ONLY_OPERATORS(X) \
+    X("++", T_INCREMENT) X("+=", T_PLUS_ASSIGN) X("%", T_MOD) X("&", T_BITAND) \
+    X("|", T_BITOR) X("^", T_BITXOR) X("~", T_BITNOT) X("?", T_QUESTION) X(".", T_DOT)
+
+#define REGEX_ONLY_OPERATORS(X) \
+    X("<<", T_OUTPUTOP) X(">>", T_INPUTOP)
+
+// ---- Recognizers generated at compile time ----
+
+template <typename T>
+struct Spelling
+{
+    std::string_view text;
+    T type = T();
+};
+
+// Keyword lookup through a perfect hash found at compile time: one hash of
+// the length and up to three bytes, one slot, one length check and one
+// memcmp, whatever the identifier.
+template <typename T, size_t N>
+class KeywordTable
+{
+public:
+    constexpr explicit KeywordTable(const Spelling<T> (&words)[N])
+        : entries(), slots(), seed(0)
+    {
+        for (size_t i = 0; i < N; i++) entries[i] = words[i];
+        for (uint32_t candidate = 1; candidate < 100000 && seed == 0; candidate++) {
+            if (tryFill(candidate)) seed = candidate;
+        }
+    }
+
+    constexpr bool valid() const { return seed != 0; }
+
+    // The keyword's type, or nullptr for an ordinary identifier.
+    const T* find(std::string_view word) const
+    {
+        if (word.empty()) return nullptr;
+        int16_t i = slots[hash(word, seed) & (Size - 1)];
+        if (i < 0) return nullptr;
+        const Spelling<T>& e = entries[(size_t)i];
+        if (e.text.size() != word.size() || e.text != word) return nullptr;
+        return &e.type;
+    }
+
+private:
+    static constexpr size_t tableSize()
+    {
+        size_t size = 8;
+        while (size < 4 * N) size *= 2;
+        return size;
+    }
+    static constexpr size_t Size = tableSize();
+
+    std::array<Spelling<T>, N> entries;
+    std::array<int16_t, Size> slots;
+    uint32_t seed;
+
+    static constexpr uint32_t hash(std::string_view s, uint32_t seed)
+    {
+        uint32_t h = seed ^ (uint32_t)s.size() * 0x9E3779B1u;
+        h = (h ^ (unsigned char)s[0]) * 0x85EBCA6Bu;
+        h = (h ^ (unsigned char)s[s.size() - 1]) * 0xC2B2AE35u;
+        h = (h ^ (unsigned char)s[s.size() / 2]) * 0x27D4EB2Fu;
+        return h ^ (h >> 16);
+    }
+
+    constexpr bool tryFill(uint32_t candidate)
+    {
+        for (size_t k = 0; k < Size; k++) slots[k] = -1;
+        for (size_t i = 0; i < N; i++) {
+            size_t k = hash(entries[i].text, candidate) & (Size - 1);
+            if (slots[k] >= 0) return false;
+            slots[k] = (int16_t)i;
+        }
+        return true;
+    }
+};
+
+// Longest-match operator recognizer: a trie whose first level is a direct
+// 256-entry table and whose deeper levels are short sibling lists.
+template <typename T, size_t N>
+class OperatorTrie
+{
+public:
+    struct Match
+    {
+        size_t length; // 0 if no operator starts here
+        T type;
+    };
+
+    constexpr explicit OperatorTrie(const Spelling<T> (&ops)[N])
+        : nodes(), first(), count(0), longestOp(0)
+    {
+        for (size_t b = 0; b < 256; b++) first[b] = -1;
+        for (size_t i = 0; i < N; i++) insert(ops[i]);
+    }
+
+    // Longest operator that is a prefix of s[0, n).
+    Match longest(const char* s, size_t n) const
+    {
+        Match best = {0, T()};
+        if (n == 0) return best;
+        int16_t node = first[(unsigned char)s[0]];
+        for (size_t i = 1; node >= 0; i++) {
+            if (nodes[(size_t)node].terminal) best = {i, nodes[(size_t)node].type};
+            if (i >= n) break;
+            node = child(node, s[i]);
+        }
+        return best;
+    }
+
+    // The operator spelled exactly s, if any.
+    const T* exact(std::string_view s) const
+    {
+        if (s.empty()) return nullptr;
+        int16_t node = first[(unsigned char)s[0]];
+        for (size_t i = 1; i < s.size() && node >= 0; i++) node = child(node, s[i]);
+        return node >= 0 && nodes[(size_t)node].terminal ? &nodes[(size_t)node].type : nullptr;
+    }
+
+    constexpr size_t maxLength() const { return longestOp; }
+
+private:
+    struct Node
+    {
+        char byte = 0;
+        int16_t child = -1;
+        int16_t sibling = -1;
+        bool terminal = false;
+        T type = T();
+    };
+
+    static constexpr size_t MaxNodes = N * 4;
+    std::array<Node, MaxNodes> nodes;
+    std::array<int16_t, 256> first;
+    size_t count;
+    size_t longestOp;
+
+    constexpr int16_t child(int16_t node, char byte) const
+    {
+        int16_t c = nodes[(size_t)node].child;
+        while (c >= 0 && nodes[(size_t)c].byte != byte) c = nodes[(size_t)c].sibling;
+        return c;
+    }
+
+    constexpr int16_t addNode(char byte)
+    {
+        nodes[count] = Node{byte, -1, -1, false, T()};
+        return (int16_t)count++;
+    }
+
+    constexpr void insert(const Spelling<T>& op)
+    {
+        int16_t& head = first[(unsigned char)op.text[0]];
+        if (head < 0) head = addNode(op.text[0]);
+        int16_t node = head;
+        for (size_t i = 1; i < op.text.size(); i++) {
+            int16_t next = child(node, op.text[i]);
+            if (next < 0) {
+                next = addNode(op.text[i]);
+                nodes[(size_t)next].sibling = nodes[(size_t)node].child;
+                nodes[(size_t)node].child = next;
+            }
+            node = next;
+        }
+        nodes[(size_t)node].terminal = true;
+        nodes[(size_t)node].type = op.type;
+        if (op.text.size() > longestOp) longestOp = op.text.size();
+    }
+};
+
+#endif
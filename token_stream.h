@@ -0,0 +1,302 @@
+#ifndef TOKEN_STREAM_H
+#define TOKEN_STREAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "source_file.h"
+
+// ---- Binary token stream (--binary FILE) ----
+//
+// A token stream for tools that would otherwise re-parse the text listing.
+// Every array has a fixed width, so a reader maps the file and indexes it in
+// place. Layout, little-endian, each section starting on an 8-byte boundary:
+//
+//   header        TokenStreamHeader
+//   type names    typeCount NUL-terminated names, the lexer's TokenType order
+//   types         uint8_t[tokenCount]
+//   values        uint32_t[tokenCount], index into the string table
+//   offsets       uint32_t[tokenCount], where each token starts in the source
+//   newlines      uint32_t[newlineCount], source offsets of every '\n'
+//   string table  uint32_t[stringCount + 1] start offsets into the bytes
+//                 that follow; value k is bytes [start[k], start[k + 1])
+//   strings       stringBytes bytes; every distinct value is stored once
+//                 per number it decodes to
+//   numbers       uint64_t[stringCount], the decoded value of each string that
+//                 is a T_INTLIT or T_FLOATLIT spelling (an int64_t, or a
+//                 double's bits), 0 for the others
+//   diagnostics   diagnosticsBytes of the lexer's error text
+//
+// Lines and columns are not stored: like the lexers, a reader finds them from
+// a token's offset by binary search in the newline offsets. Numbers are kept
+// with the strings because a literal's value is a function of its spelling;
+// a string literal or identifier with the same spelling as a number gets an
+// entry of its own, with 0, rather than sharing the number's.
+
+struct TokenStreamHeader
+{
+    char magic[8] = {'L', 'X', 'T', 'O', 'K', 'E', 'N', 'S'};
+    uint32_t version = 2;
+    uint32_t byteOrder = 0x01020304; // Written in host order; readers reject a mismatch
+    char lexer[16] = {};
+    uint32_t typeCount = 0;
+    uint32_t reserved = 0;
+    uint64_t typeNamesBytes = 0;
+    uint64_t tokenCount = 0;
+    uint64_t newlineCount = 0;
+    uint64_t stringCount = 0;
+    uint64_t stringBytes = 0;
+    uint64_t diagnosticsBytes = 0;
+    uint64_t sourceSize = 0;
+};
+
+// Builds a stream in one pass over the tokens. Values are interned by
+// content and number, so the views passed to add() must stay valid until
+// write().
+class TokenStreamWriter
+{
+public:
+    TokenStreamWriter(std::string_view lexer, const char* const typeNames[], size_t typeCount, std::string_view source)
+        : source(source)
+    {
+        std::memcpy(header.lexer, lexer.data(), std::min(lexer.size(), sizeof header.lexer - 1));
+        header.typeCount = (uint32_t)typeCount;
+        for (size_t t = 0; t < typeCount; t++) names.append(typeNames[t]).push_back('\0');
+        header.typeNamesBytes = names.size();
+        header.sourceSize = source.size();
+        for (const char* p = source.data(), *end = p + source.size(); (p = (const char*)std::memchr(p, '\n', (size_t)(end - p))); p++) {
+            newlines.push_back((uint32_t)(p - source.data()));
+        }
+    }
+
+    // number is the decoded value of a numeric literal (see numberBits()).
+    void add(unsigned type, std::string_view value, size_t offset, uint64_t number = 0)
+    {
+        auto [slot, added] = interned.try_emplace(Interned{value, number}, (uint32_t)strings.size());
+        if (added) {
+            strings.push_back(value);
+            numbers.push_back(number);
+        }
+        types.push_back((uint8_t)type);
+        values.push_back(slot->second);
+        offsets.push_back((uint32_t)offset);
+    }
+
+    void setDiagnostics(std::string text) { diagnostics = std::move(text); }
+
+    bool write(std::ostream& out)
+    {
+        std::vector<uint32_t> starts;
+        starts.reserve(strings.size() + 1);
+        uint64_t bytes = 0;
+        for (std::string_view s : strings) {
+            starts.push_back((uint32_t)bytes);
+            bytes += s.size();
+        }
+        starts.push_back((uint32_t)bytes);
+
+        header.tokenCount = types.size();
+        header.newlineCount = newlines.size();
+        header.stringCount = strings.size();
+        header.stringBytes = bytes;
+        header.diagnosticsBytes = diagnostics.size();
+
+        section(out, &header, sizeof header);
+        section(out, names.data(), names.size());
+        section(out, types.data(), types.size());
+        section(out, values.data(), values.size() * 4);
+        section(out, offsets.data(), offsets.size() * 4);
+        section(out, newlines.data(), newlines.size() * 4);
+        section(out, starts.data(), starts.size() * 4);
+        for (std::string_view s : strings) out.write(s.data(), (std::streamsize)s.size());
+        pad(out, bytes);
+        section(out, numbers.data(), numbers.size() * 8);
+        section(out, diagnostics.data(), diagnostics.size());
+        return bool(out.flush());
+    }
+
+private:
+    std::string_view source;
+    TokenStreamHeader header;
+    std::string names;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> values, offsets, newlines;
+    std::vector<std::string_view> strings;
+    std::vector<uint64_t> numbers;
+    std::string diagnostics;
+
+    struct Interned
+    {
+        std::string_view value;
+        uint64_t number;
+        bool operator==(const Interned& other) const { return number == other.number && value == other.value; }
+    };
+    struct InternedHash
+    {
+        size_t operator()(const Interned& k) const
+        {
+            return std::hash<std::string_view>()(k.value) ^ (size_t)(k.number * 0x9E3779B97F4A7C15ull);
+        }
+    };
+    std::unordered_map<Interned, uint32_t, InternedHash> interned;
+
+    static void pad(std::ostream& out, uint64_t size)
+    {
+        static const char zeros[8] = {};
+        out.write(zeros, (std::streamsize)((8 - size % 8) % 8));
+    }
+
+    static void section(std::ostream& out, const void* data, size_t size)
+    {
+        out.write(static_cast<const char*>(data), (std::streamsize)size);
+        pad(out, size);
+    }
+};
+
+// Reads a stream in place from a memory-mapped file. open() checks every
+// section against the file size and every index against its table, so the
+// accessors need no checks of their own.
+class TokenStreamReader
+{
+public:
+    bool open(const std::string& path)
+    {
+        if (!file.open(path)) return fail(file.error());
+        std::string_view data = file.view();
+        if (data.size() < sizeof header) return fail("too short");
+        std::memcpy(&header, data.data(), sizeof header);
+        if (std::memcmp(header.magic, TokenStreamHeader().magic, sizeof header.magic) != 0) return fail("not a token stream");
+        if (header.version != TokenStreamHeader().version) return fail("unsupported version " + std::to_string(header.version));
+        if (header.byteOrder != TokenStreamHeader().byteOrder) return fail("written with the other byte order");
+
+        uint64_t at = sizeof header;
+        const char* base = data.data();
+        auto take = [&](uint64_t count, uint64_t width, const char*& section) {
+            if (count > (data.size() - std::min<uint64_t>(at, data.size())) / width) return false;
+            section = base + at;
+            at += (count * width + 7) / 8 * 8;
+            return true;
+        };
+        const char* strings = nullptr;
+        if (!take(header.typeNamesBytes, 1, names) || !take(header.tokenCount, 1, types) ||
+            !take(header.tokenCount, 4, values) || !take(header.tokenCount, 4, offsets) ||
+            !take(header.newlineCount, 4, newlines) || !take(header.stringCount + 1, 4, starts) ||
+            !take(header.stringBytes, 1, strings) || !take(header.stringCount, 8, numbers) ||
+            !take(header.diagnosticsBytes, 1, diagnosticText)) {
+            return fail("truncated");
+        }
+        stringData = strings;
+
+        typeNames.clear();
+        for (std::string_view rest(names, header.typeNamesBytes); typeNames.size() < header.typeCount; ) {
+            size_t nul = rest.find('\0');
+            if (nul == std::string_view::npos) return fail("bad type names");
+            typeNames.push_back(rest.substr(0, nul));
+            rest.remove_prefix(nul + 1);
+        }
+        for (uint64_t k = 0; k < header.stringCount; k++) {
+            if (u32(starts, k) > u32(starts, k + 1)) return fail("bad string table");
+        }
+        if (u32(starts, header.stringCount) > header.stringBytes) return fail("bad string table");
+        for (uint64_t k = 1; k < header.newlineCount; k++) {
+            if (u32(newlines, k - 1) >= u32(newlines, k)) return fail("bad newline offsets");
+        }
+        for (uint64_t i = 0; i < header.tokenCount; i++) {
+            if ((uint8_t)types[i] >= header.typeCount || u32(values, i) >= header.stringCount) return fail("bad token");
+        }
+        return true;
+    }
+
+    const std::string& error() const { return problem; }
+
+    std::string_view lexer() const
+    {
+        std::string_view name(header.lexer, sizeof header.lexer);
+        return name.substr(0, name.find('\0'));
+    }
+    size_t size() const { return header.tokenCount; }
+    unsigned type(size_t i) const { return (uint8_t)types[i]; }
+    std::string_view typeName(unsigned type) const { return typeNames[type]; }
+    size_t offset(size_t i) const { return u32(offsets, i); }
+
+    std::string_view value(size_t i) const
+    {
+        uint32_t k = u32(values, i);
+        uint32_t start = u32(starts, k);
+        return std::string_view(stringData + start, u32(starts, k + 1) - start);
+    }
+
+    // Decoded value of token i, a T_INTLIT or T_FLOATLIT.
+    int64_t intValue(size_t i) const { return (int64_t)u64(numbers, u32(values, i)); }
+    double floatValue(size_t i) const
+    {
+        uint64_t bits = u64(numbers, u32(values, i));
+        double value;
+        std::memcpy(&value, &bits, sizeof value);
+        return value;
+    }
+
+    // 1-based line and column of token i.
+    int line(size_t i) const { return (int)newlinesBefore(offset(i)) + 1; }
+    int column(size_t i) const
+    {
+        size_t k = newlinesBefore(offset(i));
+        size_t lineStart = k ? u32(newlines, k - 1) + 1 : 0;
+        return (int)(offset(i) - lineStart) + 1;
+    }
+
+    std::string_view diagnostics() const { return std::string_view(diagnosticText, header.diagnosticsBytes); }
+
+private:
+    SourceFile file;
+    TokenStreamHeader header;
+    const char* names = nullptr;
+    const char* types = nullptr;
+    const char* values = nullptr;
+    const char* offsets = nullptr;
+    const char* newlines = nullptr;
+    const char* starts = nullptr;
+    const char* stringData = nullptr;
+    const char* numbers = nullptr;
+    const char* diagnosticText = nullptr;
+    std::vector<std::string_view> typeNames;
+    std::string problem;
+
+    static uint32_t u32(const char* array, uint64_t i)
+    {
+        uint32_t v;
+        std::memcpy(&v, array + i * 4, 4);
+        return v;
+    }
+
+    static uint64_t u64(const char* array, uint64_t i)
+    {
+        uint64_t v;
+        std::memcpy(&v, array + i * 8, 8);
+        return v;
+    }
+
+    size_t newlinesBefore(size_t offset) const
+    {
+        size_t lo = 0, hi = header.newlineCount;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (u32(newlines, mid) < offset) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    bool fail(std::string why)
+    {
+        problem = std::move(why);
+        return false;
+    }
+};
+
+#endif
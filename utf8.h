@@ -0,0 +1,72 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include "unicode_xid.h"
+
+// One decoded UTF-8 sequence. An invalid one spans its maximal subpart
+// (Unicode 14.0, section 3.9): the longest prefix of a well-formed sequence,
+// or the single offending byte, so a decoder that replaces each with U+FFFD
+// agrees with every other conforming one. incomplete marks a sequence that
+// was still well-formed where the input ran out: more bytes might finish it.
+struct Utf8Char
+{
+    uint32_t cp = 0;
+    size_t length = 1;
+    bool valid = false;
+    bool incomplete = false;
+};
+
+// Decodes the sequence at s[0, n), n >= 1, by the well-formed byte ranges of
+// Table 3-7, which rule out overlong forms, surrogates and code points past
+// U+10FFFF without decoding them first.
+inline Utf8Char decodeUtf8(const char* s, size_t n)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+    Utf8Char ch;
+    unsigned char b = u[0];
+    if (b < 0x80) {
+        ch.cp = b;
+        ch.valid = true;
+        return ch;
+    }
+    size_t need;
+    unsigned char lo = 0x80, hi = 0xBF; // Range of the second byte
+    if (b >= 0xC2 && b <= 0xDF) need = 2;
+    else if (b >= 0xE0 && b <= 0xEF) {
+        need = 3;
+        if (b == 0xE0) lo = 0xA0;
+        else if (b == 0xED) hi = 0x9F;
+    }
+    else if (b >= 0xF0 && b <= 0xF4) {
+        need = 4;
+        if (b == 0xF0) lo = 0x90;
+        else if (b == 0xF4) hi = 0x8F;
+    }
+    else {
+        return ch;
+    }
+    uint32_t cp = b & (0xFF >> (need + 1));
+    for (size_t k = 1; k < need; k++) {
+        if (k == n) {
+            ch.length = k;
+            ch.incomplete = true;
+            return ch;
+        }
+        unsigned char c = u[k];
+        if (c < lo || c > hi) {
+            ch.length = k;
+            return ch;
+        }
+        cp = cp << 6 | (c & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    ch.cp = cp;
+    ch.length = need;
+    ch.valid = true;
+    return ch;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <charconv>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Parses a --jobs argument: a thread count up to 1024, 0 meaning one per
+// core. False if text is not such a number.
+inline bool parseJobs(std::string_view text, unsigned& jobs)
+{
+    unsigned n;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), n);
+    if (ec != std::errc() || end != text.data() + text.size() || n > 1024) return false;
+    jobs = n ? n : std::max(1u, std::thread::hardware_concurrency());
+    return true;
+}
+
+// Fixed set of worker threads with one task deque each. A worker runs its own
+// newest task first and, when it runs dry, steals the oldest task of another
+// worker, so work submitted from inside a task (a large file forking its
+// slices) stays with that worker unless others are idle. parallelFor() is
+// fork-join: the caller keeps running tasks until its own are done, so it
+// may be called from inside a task, and a pool with no workers simply runs
+// everything on the calling thread.
+class WorkPool
+{
+public:
+    explicit WorkPool(unsigned workers) : queues(std::max(1u, workers))
+    {
+        for (unsigned i = 0; i < workers; i++) threads.emplace_back([this, i] { workerLoop((int)i); });
+    }
+
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    // Runs every queued task before returning.
+    ~WorkPool() { finish(); }
+
+    // Runs every queued task, including any they submit, and joins the
+    // workers, while the pool is still whole: for an owner whose tasks reach
+    // the pool through it. Afterwards parallelFor() runs on the caller, and a
+    // task submitted waits for the next finish() or the destructor.
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+        threads.clear();
+        while (runOne(-1)) {}
+    }
+
+    // Threads that may run tasks at once: the workers plus the thread
+    // waiting in parallelFor().
+    unsigned concurrency() const { return (unsigned)threads.size() + 1; }
+
+    void submit(std::function<void()> task)
+    {
+        size_t q = workerIndex() >= 0 && owner() == this ? (size_t)workerIndex() : nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[q].mutex);
+            queues[q].tasks.push_back(std::move(task));
+        }
+        pending++;
+        { std::lock_guard<std::mutex> lock(sleepMutex); } // Pairs with the predicate check in workerLoop
+        wake.notify_one();
+    }
+
+    // Runs body(0) .. body(count - 1) and returns when all have finished.
+    void parallelFor(size_t count, const std::function<void(size_t)>& body)
+    {
+        if (threads.empty()) {
+            for (size_t i = 0; i < count; i++) body(i);
+            return;
+        }
+        std::atomic<size_t> remaining(count);
+        for (size_t i = 0; i < count; i++) {
+            submit([&body, &remaining, i] {
+                body(i);
+                remaining--;
+            });
+        }
+        while (remaining > 0) {
+            if (!help()) std::this_thread::yield();
+        }
+    }
+
+    // Runs one queued task on the calling thread, if there is one, so a
+    // thread waiting on the pool's results can make progress itself.
+    bool help() { return runOne(owner() == this ? workerIndex() : -1); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> nextQueue{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static int& workerIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    static WorkPool*& owner()
+    {
+        static thread_local WorkPool* pool = nullptr;
+        return pool;
+    }
+
+    // Runs the newest task of queue self, or else the oldest task found in
+    // any other queue. self < 0 only steals.
+    bool runOne(int self)
+    {
+        std::function<void()> task;
+        size_t n = queues.size();
+        if (self >= 0) {
+            Queue& q = queues[(size_t)self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+        }
+        for (size_t k = 0; !task && k < n; k++) {
+            Queue& q = queues[self < 0 ? k : ((size_t)self + 1 + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+        pending--;
+        task();
+        return true;
+    }
+
+    void workerLoop(int index)
+    {
+        workerIndex() = index;
+        owner() = this;
+        while (true) {
+            if (runOne(index)) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+};
+
+#endif